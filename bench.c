@@ -0,0 +1,752 @@
+// Benchmarks for the comscript interpreter.
+// Each result is printed as a line of: name <tab> value <tab> unit
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // for clock_gettime under strict modes such as -std=c99
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Include the images program for its words, but not its main()
+#define IMAGES_NO_MAIN
+#include "images.c"
+
+// Current time in nanoseconds
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void report(const char *name, double value, const char *unit)
+{
+	printf("%s\t%.2f\t%s\n", name, value, unit);
+}
+
+// Report a time per word both as ns/word and as millions of words per second.
+static void report_words(const char *name, double ns)
+{
+	report(name, ns, "ns/word");
+	report(name, 1e3 / ns, "Mwords/s");
+}
+
+// Each timing is repeated and the fastest one is reported, which keeps the
+// results steady from run to run.
+#define BENCH_REPEAT 5
+
+#if COMSCRIPT_THREADED
+#define DISPATCH "threaded"
+#else
+#define DISPATCH "switch"
+#endif
+#if COMSCRIPT_TOS_CACHE
+#define ENGINE DISPATCH "+tos"
+#else
+#define ENGINE DISPATCH
+#endif
+
+static void noop(void)
+{
+}
+
+// Wrappers, so that the core words are called instead of executed inline
+static void add_call(void)       { add(); }
+static void multiply_call(void)  { multiply(); }
+static void drop_call(void)      { drop(); }
+static void duplicate_call(void) { duplicate(); }
+static void swap_call(void)      { swap(); }
+static void over_call(void)      { over(); }
+static void nip_call(void)       { nip(); }
+
+static struct WordLookup coreWords[] =
+{
+	WORD_ENTRY(1, "+",    add,       2, 1, 0, NULL),
+	WORD_ENTRY(1, "*",    multiply,  2, 1, 0, NULL),
+	WORD_ENTRY(4, "drop", drop,      1, 0, 0, NULL),
+	WORD_ENTRY(3, "dup",  duplicate, 1, 2, 0, NULL),
+	WORD_ENTRY(4, "swap", swap,      2, 2, 0, NULL),
+	WORD_ENTRY(4, "over", over,      2, 3, 0, NULL),
+	WORD_ENTRY(3, "nip",  nip,       2, 1, 0, NULL),
+};
+static struct WordDict coreDict =
+{
+	.len = sizeof(coreWords)/sizeof(coreWords[0]),
+	.words = coreWords,
+};
+
+static struct WordLookup callWords[] =
+{
+	WORD_ENTRY(1, "+",    add_call,       2, 1, 0, NULL),
+	WORD_ENTRY(1, "*",    multiply_call,  2, 1, 0, NULL),
+	WORD_ENTRY(4, "drop", drop_call,      1, 0, 0, NULL),
+	WORD_ENTRY(3, "dup",  duplicate_call, 1, 2, 0, NULL),
+	WORD_ENTRY(4, "swap", swap_call,      2, 2, 0, NULL),
+	WORD_ENTRY(4, "over", over_call,      2, 3, 0, NULL),
+	WORD_ENTRY(3, "nip",  nip_call,       2, 1, 0, NULL),
+};
+static struct WordDict callDict =
+{
+	.len = sizeof(callWords)/sizeof(callWords[0]),
+	.words = callWords,
+};
+
+// Stack-neutral sequence of core words
+static const char dispatchChunk[] = "1 2 + 3 dup * swap over nip drop drop ";
+static const int dispatchChunkWords = 12;
+
+// Build a script from n copies of a chunk of code.
+static char *repeat(const char *chunk, int n, int *len)
+{
+	int chunkLen = strlen(chunk);
+	char *script = malloc(chunkLen * n + 1);
+	for (int i = 0; i < n; i++)
+	{
+		memcpy(script + i * chunkLen, chunk, chunkLen);
+	}
+	script[chunkLen * n] = 0;
+	*len = chunkLen * n;
+	return script;
+}
+
+// Ways to run a script in bench_run
+enum
+{
+	RUN_TEXT,     // runScript
+	RUN_COMPILED, // runCode
+	RUN_UNCHECKED, // runCode with no per-word stack checks, but no superinstructions
+	RUN_FUSED,    // runCode with superinstructions
+	RUN_VERIFIED, // runCode with superinstructions and no per-word stack checks
+	RUN_JIT,      // runCode with machine code from jitCode
+};
+
+// Time the words of a script run through runScript or runCode.
+static void bench_run(const char *name, int mode, int len, const char *script, int words, struct WordDict *d, int runs)
+{
+	struct Code code = {0};
+	compileScript(len, script, d, &code);
+	if (mode == RUN_FUSED || mode == RUN_VERIFIED || mode == RUN_JIT)
+	{
+		fuseCode(&code);
+	}
+	if ((mode == RUN_UNCHECKED || mode == RUN_VERIFIED) && verifyCode(&code, d))
+	{
+		printf("%s: could not verify\n", name);
+		exit(1);
+	}
+	if (mode == RUN_JIT && jitCode(&code, d))
+	{
+		// Not supported on this machine
+		freeCode(&code);
+		return;
+	}
+	double best = 0;
+	for (int k = 0; k < BENCH_REPEAT; k++)
+	{
+		double t0 = now();
+		for (int r = 0; r < runs; r++)
+		{
+			dreset();
+			int err = (mode == RUN_TEXT)? runScript(len, script, d) : runCode(&code, d);
+			if (err)
+			{
+				printf("%s: %s\n", name, errMessage(err));
+				exit(1);
+			}
+		}
+		double t = now() - t0;
+		if (k == 0 || t < best)
+		{
+			best = t;
+		}
+	}
+	freeCode(&code);
+	report_words(name, best / ((double)runs * words));
+}
+
+// Compare dispatch of the core words through each execution path.
+static void bench_dispatch(void)
+{
+	const int n = 1000;
+	const int runs = 500;
+	int len;
+	char *script = repeat(dispatchChunk, n, &len);
+	int words = n * dispatchChunkWords;
+	bench_run("dispatch.text", RUN_TEXT, len, script, words, &coreDict, runs / 10);
+	bench_run("dispatch.call." ENGINE, RUN_COMPILED, len, script, words, &callDict, runs);
+	bench_run("dispatch.inline." ENGINE, RUN_COMPILED, len, script, words, &coreDict, runs);
+	bench_run("dispatch.fused." ENGINE, RUN_FUSED, len, script, words, &coreDict, runs);
+	bench_run("dispatch.verified." ENGINE, RUN_VERIFIED, len, script, words, &coreDict, runs);
+	bench_run("dispatch.jit", RUN_JIT, len, script, words, &coreDict, runs);
+	free(script);
+}
+
+// Measure what the per-word stack checks cost, by running the same code
+// with and without them and without superinstructions in either case.
+static void bench_checks(void)
+{
+	const int n = 1000;
+	const int runs = 500;
+	int len;
+	char *script = repeat(dispatchChunk, n, &len);
+	int words = n * dispatchChunkWords;
+	bench_run("checks.on." ENGINE, RUN_COMPILED, len, script, words, &coreDict, runs);
+	bench_run("checks.off." ENGINE, RUN_UNCHECKED, len, script, words, &coreDict, runs);
+	free(script);
+}
+
+// Time number parsing: the text interpreter parses every number each run,
+// compileScript parses them once, and runCode only pushes the results.
+static void bench_numbers(void)
+{
+	static const char chunk[] = "7 42 1234 65535 2147483 drop drop drop drop drop ";
+	const int chunkWords = 10;
+	const int n = 1000;
+	const int runs = 200;
+	int len;
+	char *script = repeat(chunk, n, &len);
+	int words = n * chunkWords;
+	bench_run("numbers.text", RUN_TEXT, len, script, words, &coreDict, runs / 10);
+
+	double best = 0;
+	for (int k = 0; k < BENCH_REPEAT; k++)
+	{
+		double t0 = now();
+		for (int r = 0; r < runs / 10; r++)
+		{
+			struct Code code = {0};
+			compileScript(len, script, &coreDict, &code);
+			freeCode(&code);
+		}
+		double t = now() - t0;
+		if (k == 0 || t < best)
+		{
+			best = t;
+		}
+	}
+	report_words("numbers.compile", best / ((double)(runs / 10) * words));
+
+	bench_run("numbers.compiled." ENGINE, RUN_COMPILED, len, script, words, &coreDict, runs);
+	bench_run("numbers.verified." ENGINE, RUN_VERIFIED, len, script, words, &coreDict, runs);
+	free(script);
+}
+
+// Time find() on a dictionary of n words, without and with the hash index.
+static void bench_find(int n)
+{
+	struct WordDict d = {0};
+	d.len = n;
+	d.words = calloc(n, sizeof(*d.words));
+	char *names = malloc(n * 16);
+	for (int i = 0; i < n; i++)
+	{
+		char *name = names + i * 16;
+		d.words[i].len = snprintf(name, 16, "word%d", i);
+		d.words[i].name = name;
+		d.words[i].func = noop;
+	}
+
+	const int lookups = 200000;
+	int results[2] = {0};
+	double ns[2];
+	for (int indexed = 0; indexed < 2; indexed++)
+	{
+		if (indexed)
+		{
+			indexDict(&d);
+		}
+		double t0 = now();
+		for (int k = 0; k < lookups; k++)
+		{
+			struct WordLookup *w = &d.words[(k * 7919) % n];
+			results[indexed] += find(&d, w->len, w->name);
+		}
+		ns[indexed] = (now() - t0) / lookups;
+	}
+	if (results[0] != results[1])
+	{
+		printf("find: hashed results differ from linear search\n");
+		exit(1);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "find.linear.%d", n);
+	report(name, ns[0], "ns/lookup");
+	snprintf(name, sizeof(name), "find.hashed.%d", n);
+	report(name, ns[1], "ns/lookup");
+
+	freeDictIndex(&d);
+	free(names);
+	free(d.words);
+}
+
+// Compare a loop over a quote with `times` against the same words as
+// straight-line code, and against re-interpreting the quote text each time.
+static void bench_times(void)
+{
+	const char body[] = "1 2 + 3 dup * swap over nip drop drop";
+	const int n = 100000;
+	char script[128];
+	int len = snprintf(script, sizeof(script), "[ %s ] %d times", body, n);
+	bench_run("times.compiled." ENGINE, RUN_COMPILED, len, script, n * dispatchChunkWords, &dict, 10);
+
+	// The same loop with for and next, which stays in runCode
+	len = snprintf(script, sizeof(script), "%d for %s next", n, body);
+	bench_run("times.for." ENGINE, RUN_VERIFIED, len, script, n * dispatchChunkWords, &dict, 10);
+
+	// What do_times did before quotes were compiled
+	double t0 = now();
+	for (int i = 0; i < n; i++)
+	{
+		runScript(sizeof(body) - 1, body, &dict);
+	}
+	report_words("times.text", (now() - t0) / ((double)n * dispatchChunkWords));
+}
+
+// Size of the images in bench_images: an 8K canvas
+#define BENCH_IMAGE_W 7680
+#define BENCH_IMAGE_H 4320
+
+// Report the bandwidth of moving a number of bytes in some nanoseconds.
+static void report_bandwidth(const char *name, double bytes, double ns)
+{
+	report(name, bytes / ns, "GB/s");
+}
+
+// The fillrect and blit loops from before the kernels walked rows: x outer
+// and y inner, so that each pixel is a whole row away from the last one.
+// They take their arguments from the stack like the words they stand for.
+
+// ( img val -- img )
+static void fill_columns(void)
+{
+	int val = dpop();
+	struct Image *p = imagesArr[dpick(0)];
+	for (int x = 0; x < p->width; x++)
+	{
+		for (int y = 0; y < p->height; y++)
+		{
+			p->colors[x + (size_t)y * p->width] = val;
+		}
+	}
+}
+
+// ( img1 img2 -- img1 )
+static void blit_columns(void)
+{
+	struct Image *p2 = imagesArr[dpop()];
+	struct Image *p1 = imagesArr[dpick(0)];
+	for (int x = 0; x < p2->width && x < p1->width; x++)
+	{
+		for (int y = 0; y < p2->height && y < p1->height; y++)
+		{
+			p1->colors[x + (size_t)y * p1->width] = p2->colors[x + (size_t)y * p2->width];
+		}
+	}
+}
+
+// Push the arguments of an image word and call it.
+static void call_word(void (*func)(void), int n, const int *args)
+{
+	for (int i = 0; i < n; i++)
+	{
+		dpush(args[i]);
+	}
+	func();
+}
+
+// Time an image word, and return the fastest of BENCH_REPEAT runs in ns.
+static double time_word(void (*func)(void), int n, const int *args)
+{
+	double best = 0;
+	for (int k = 0; k < BENCH_REPEAT; k++)
+	{
+		double t0 = now();
+		call_word(func, n, args);
+		double t = now() - t0;
+		dreset();
+		best = (k == 0 || t < best)? t : best;
+	}
+	return best;
+}
+
+// Time the image words on large images, against the column order loops.
+static void bench_images(void)
+{
+	const int w = BENCH_IMAGE_W;
+	const int h = BENCH_IMAGE_H;
+	const double bytes = (double)w * h * sizeof(int);
+	dreset();
+	call_word(img_alloc, 2, (int[]){w, h});
+	int a = dpop();
+	call_word(img_alloc, 2, (int[]){w, h});
+	int b = dpop();
+	// Not a value that fill_scalar can memset
+	const int val = 0x12345678;
+
+	report_bandwidth("image.clear", bytes, time_word(img_clear, 2, (int[]){a, val}));
+	report_bandwidth("image.fillrect", bytes, time_word(img_fillrect, 6, (int[]){a, 0, 0, w, h, val}));
+	report_bandwidth("image.fillrect.columns", bytes, time_word(fill_columns, 2, (int[]){a, val}));
+
+	// Blitting reads one image and writes the other
+	report_bandwidth("image.blit", 2 * bytes, time_word(img_blit, 4, (int[]){b, a, 0, 0}));
+	report_bandwidth("image.blit.columns", 2 * bytes, time_word(blit_columns, 2, (int[]){b, a}));
+
+	// Crop a copy of the image to its middle quarter
+	double best = 0;
+	for (int k = 0; k < BENCH_REPEAT; k++)
+	{
+		call_word(img_copy, 1, (int[]){a});
+		int c = dpop();
+		dreset();
+		double t0 = now();
+		call_word(img_crop, 5, (int[]){c, w / 4, h / 4, w / 2, h / 2});
+		double t = now() - t0;
+		dreset();
+		call_word(img_free, 1, (int[]){c});
+		best = (k == 0 || t < best)? t : best;
+	}
+	report_bandwidth("image.crop", bytes / 2, best);
+
+	call_word(img_free, 1, (int[]){a});
+	call_word(img_free, 1, (int[]){b});
+}
+
+// Time each fill kernel the CPU has, on pixels that stay in the cache and
+// with streaming stores on an image larger than it.
+static void bench_fill(void)
+{
+	const size_t small = 1 << 16;
+	const size_t large = (size_t)BENCH_IMAGE_W * BENCH_IMAGE_H;
+	int *pixels = malloc(large * sizeof(int));
+	memset(pixels, 0, large * sizeof(int));
+	for (int i = 0; i < numFillKernels; i++)
+	{
+		struct FillKernel *f = &fillKernels[i];
+		if (!has_cpu(f->needs))
+		{
+			continue;
+		}
+		char name[64];
+		const int runs = 1000;
+		double best = 0;
+		for (int k = 0; k < BENCH_REPEAT; k++)
+		{
+			double t0 = now();
+			for (int r = 0; r < runs; r++)
+			{
+				f->fill(pixels, small, r, 0);
+			}
+			double t = now() - t0;
+			best = (k == 0 || t < best)? t : best;
+		}
+		snprintf(name, sizeof(name), "fill.%s", f->name);
+		report_bandwidth(name, (double)runs * small * sizeof(int), best);
+
+		for (int stream = 0; stream < 2; stream++)
+		{
+			for (int k = 0; k < BENCH_REPEAT; k++)
+			{
+				double t0 = now();
+				f->fill(pixels, large, k + 0x01020304, stream);
+				double t = now() - t0;
+				best = (k == 0 || t < best)? t : best;
+			}
+			snprintf(name, sizeof(name), "fill.%s.large%s", f->name, stream? ".stream" : "");
+			report_bandwidth(name, (double)large * sizeof(int), best);
+		}
+	}
+	free(pixels);
+}
+
+// Time each blend kernel the CPU has in each mode, and the blit words that
+// use the fastest one, on sprites drawn onto an 8K image.
+static void bench_blend(void)
+{
+	static const char *modes[] = {"copy", "over", "add", "mul"};
+	const size_t n = 1 << 16;
+	int *src = malloc(n * sizeof(int));
+	int *dst = malloc(n * sizeof(int));
+	for (size_t i = 0; i < n; i++)
+	{
+		src[i] = (int)(i * 2654435761u);
+		dst[i] = (int)(i * 40503u);
+	}
+	for (int i = 0; i < numBlendKernels; i++)
+	{
+		struct BlendKernel *b = &blendKernels[i];
+		if (!has_cpu(b->needs))
+		{
+			continue;
+		}
+		for (int mode = BLIT_OVER; mode <= BLIT_MULTIPLY; mode++)
+		{
+			const int runs = 200;
+			double best = 0;
+			for (int k = 0; k < BENCH_REPEAT; k++)
+			{
+				double t0 = now();
+				for (int r = 0; r < runs; r++)
+				{
+					b->blend(mode, dst, src, n);
+				}
+				double t = now() - t0;
+				best = (k == 0 || t < best)? t : best;
+			}
+			char name[64];
+			snprintf(name, sizeof(name), "blend.%s.%s", modes[mode], b->name);
+			report(name, (double)runs * n / best * 1e3, "Mpixels/s");
+		}
+	}
+	free(src);
+	free(dst);
+
+	// 256x256 sprites, all over the canvas
+	dreset();
+	call_word(img_alloc, 2, (int[]){BENCH_IMAGE_W, BENCH_IMAGE_H});
+	int canvas = dpop();
+	call_word(img_alloc, 2, (int[]){256, 256});
+	int sprite = dpop();
+	call_word(img_clear, 2, (int[]){canvas, 0xff203040});
+	call_word(img_clear, 2, (int[]){sprite, 0x80a0b0c0});
+	dreset();
+	void (*words[])(void) = {img_blit, img_blit_over, img_blit_add, img_blit_multiply};
+	const int sprites = 500;
+	for (int mode = BLIT_COPY; mode <= BLIT_MULTIPLY; mode++)
+	{
+		double best = 0;
+		for (int k = 0; k < BENCH_REPEAT; k++)
+		{
+			double t0 = now();
+			for (int i = 0; i < sprites; i++)
+			{
+				int x = (i * 7919) % BENCH_IMAGE_W - 128;
+				int y = (i * 104729) % BENCH_IMAGE_H - 128;
+				call_word(words[mode], 4, (int[]){canvas, sprite, x, y});
+				dreset();
+			}
+			double t = now() - t0;
+			best = (k == 0 || t < best)? t : best;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "image.blit.%s", modes[mode]);
+		report(name, sprites / best * 1e9, "sprites/s");
+	}
+	call_word(img_free, 1, (int[]){sprite});
+	call_word(img_free, 1, (int[]){canvas});
+}
+
+// Time the image words on 8K images with their rows split across a pool of
+// threads.
+static void bench_pool(int threads)
+{
+	const int w = BENCH_IMAGE_W;
+	const int h = BENCH_IMAGE_H;
+	const double bytes = (double)w * h * sizeof(int);
+	pool_start(threads);
+	dreset();
+	call_word(img_alloc, 2, (int[]){w, h});
+	int a = dpop();
+	call_word(img_alloc, 2, (int[]){w, h});
+	int b = dpop();
+	call_word(img_clear, 2, (int[]){b, 0x80604020});
+	dreset();
+
+	char name[64];
+	snprintf(name, sizeof(name), "pool.%d.clear", threads);
+	report_bandwidth(name, bytes, time_word(img_clear, 2, (int[]){a, 0x12345678}));
+	snprintf(name, sizeof(name), "pool.%d.fillrect", threads);
+	report_bandwidth(name, bytes, time_word(img_fillrect, 6, (int[]){a, 1, 1, w - 2, h - 2, 0x12345678}));
+	snprintf(name, sizeof(name), "pool.%d.blit", threads);
+	report_bandwidth(name, 2 * bytes, time_word(img_blit, 4, (int[]){a, b, 0, 0}));
+	// The images are the same now, so img= compares every pixel
+	snprintf(name, sizeof(name), "pool.%d.img=", threads);
+	report_bandwidth(name, 2 * bytes, time_word(img_equal, 2, (int[]){a, b}));
+	snprintf(name, sizeof(name), "pool.%d.blit.over", threads);
+	report_bandwidth(name, 2 * bytes, time_word(img_blit_over, 4, (int[]){a, b, 0, 0}));
+
+	call_word(img_free, 1, (int[]){a});
+	call_word(img_free, 1, (int[]){b});
+	pool_stop();
+}
+
+// Draw sprites and lines onto a sparse 50000x50000 tiled image, and count
+// the tiles that were allocated.
+static void bench_tiles(void)
+{
+	const int size = 50000;
+	dreset();
+	call_word(img_alloc_tiled, 2, (int[]){size, size});
+	int canvas = dpop();
+	call_word(img_alloc, 2, (int[]){256, 256});
+	int sprite = dpop();
+	call_word(img_clear, 2, (int[]){sprite, 0x80a0b0c0});
+	dreset();
+
+	const int sprites = 500;
+	double t0 = now();
+	for (int i = 0; i < sprites; i++)
+	{
+		int x = (int)((i * 7919LL) % size) - 128;
+		int y = (int)((i * 104729LL) % size) - 128;
+		call_word(img_blit_over, 4, (int[]){canvas, sprite, x, y});
+		dreset();
+	}
+	report("tiles.blit.over", sprites / (now() - t0) * 1e9, "sprites/s");
+
+	const int lines = 10;
+	double pixels = 0;
+	t0 = now();
+	for (int i = 0; i < lines; i++)
+	{
+		int x1 = (int)((i * 7919LL) % size);
+		int y0 = i * 4000;
+		call_word(img_line, 6, (int[]){canvas, 0, y0, x1, size - 1, 0xff000000});
+		dreset();
+		pixels += (x1 > size - 1 - y0)? x1 + 1 : size - y0;
+	}
+	report("tiles.line", pixels / (now() - t0) * 1e3, "Mpixels/s");
+
+	struct Image *p = imagesArr[canvas];
+	size_t used = 0;
+	for (size_t t = 0; t < (size_t)p->tilesX * p->tilesY; t++)
+	{
+		used += p->tiles[t] != NULL;
+	}
+	report("tiles.memory", used * TILE_SIZE * TILE_SIZE * sizeof(int) / 1048576.0, "MiB");
+	call_word(img_free, 1, (int[]){sprite});
+	call_word(img_free, 1, (int[]){canvas});
+}
+
+struct ParallelJob
+{
+	struct ComInterp interp;
+	struct Code *code;
+	int runs;
+	int err;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct ParallelJob *job = arg;
+	for (int r = 0; r < job->runs && !job->err; r++)
+	{
+		job->err = comRunCode(&job->interp, job->code);
+	}
+	return NULL;
+}
+
+// Run the same compiled code on several threads, each with its own interpreter.
+static void bench_parallel(int threads)
+{
+	const int n = 1000;
+	const int runs = 500;
+	int len;
+	char *script = repeat(dispatchChunk, n, &len);
+	struct Code code = {0};
+	compileScript(len, script, &coreDict, &code);
+
+	pthread_t tids[64];
+	struct ParallelJob jobs[64];
+	double t0 = now();
+	for (int i = 0; i < threads; i++)
+	{
+		comInit(&jobs[i].interp, &coreDict);
+		jobs[i].code = &code;
+		jobs[i].runs = runs;
+		jobs[i].err = 0;
+		pthread_create(&tids[i], NULL, parallel_worker, &jobs[i]);
+	}
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(tids[i], NULL);
+		if (jobs[i].err || jobs[i].interp.sp != 0)
+		{
+			printf("parallel: thread %d failed\n", i);
+			exit(1);
+		}
+	}
+	double seconds = (now() - t0) / 1e9;
+
+	char name[64];
+	snprintf(name, sizeof(name), "parallel.%d." ENGINE, threads);
+	report(name, (double)threads * runs * n * dispatchChunkWords / seconds / 1e6, "Mwords/s");
+	freeCode(&code);
+	free(script);
+}
+
+// Whether a group of benchmarks was asked for on the command line.
+// With no arguments, every group runs.
+static int wanted(int argc, char **argv, const char *group)
+{
+	if (argc < 2)
+	{
+		return 1;
+	}
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], group))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	indexDict(&dict);
+	if (wanted(argc, argv, "find"))
+	{
+		bench_find(40);
+		bench_find(1000);
+		bench_find(5000);
+		bench_find(20000);
+	}
+	if (wanted(argc, argv, "dispatch"))
+	{
+		bench_dispatch();
+	}
+	if (wanted(argc, argv, "checks"))
+	{
+		bench_checks();
+	}
+	if (wanted(argc, argv, "numbers"))
+	{
+		bench_numbers();
+	}
+	if (wanted(argc, argv, "times"))
+	{
+		bench_times();
+	}
+	if (wanted(argc, argv, "images"))
+	{
+		bench_images();
+	}
+	if (wanted(argc, argv, "fill"))
+	{
+		bench_fill();
+	}
+	if (wanted(argc, argv, "blend"))
+	{
+		bench_blend();
+	}
+	if (wanted(argc, argv, "tiles"))
+	{
+		bench_tiles();
+	}
+	if (wanted(argc, argv, "pool"))
+	{
+		int cores = sysconf(_SC_NPROCESSORS_ONLN);
+		bench_pool(1);
+		bench_pool(cores > 4? cores : 4);
+	}
+	if (wanted(argc, argv, "parallel"))
+	{
+		bench_parallel(1);
+		bench_parallel(4);
+	}
+	return 0;
+}
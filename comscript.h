@@ -1,13 +1,127 @@
 #ifndef __COMSCRIPT_H
 #define __COMSCRIPT_H
 
+// The implementation uses MAP_ANONYMOUS, mkstemp and clock_gettime, which
+// strict modes such as -std=c99 hide. This only works if no system header
+// was included before this one.
+#if defined(COMSCRIPT_IMPLEMENTATION) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+
 #ifndef DATA_STACK_SZ
 #define DATA_STACK_SZ 100
 #endif /* DATA_STACK_SZ */
 
+// Initial size of the runStream buffer. It only grows to fit a single word or
+// quote that is larger.
+#ifndef STREAM_BUF_SZ
+#define STREAM_BUF_SZ 65536
+#endif /* STREAM_BUF_SZ */
+
+// Size of the blocks that an Arena allocates
+#ifndef ARENA_BLOCK_SZ
+#define ARENA_BLOCK_SZ 65536
+#endif /* ARENA_BLOCK_SZ */
+
+// Maximum nesting of if, begin and for in compiled code
+#ifndef CONTROL_DEPTH
+#define CONTROL_DEPTH 32
+#endif /* CONTROL_DEPTH */
+
+// Optional JIT compiler (jitCode) for x86-64 Linux
+#ifndef COMSCRIPT_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define COMSCRIPT_JIT 1
+#else
+#define COMSCRIPT_JIT 0
+#endif
+#endif /* COMSCRIPT_JIT */
+
+// Keep the top of the stack in a local in runCode, instead of in the
+// interpreter's stack, between words written in C.
+#ifndef COMSCRIPT_TOS_CACHE
+#define COMSCRIPT_TOS_CACHE 1
+#endif /* COMSCRIPT_TOS_CACHE */
+
+// Count the calls and time of every word that runScript and runCode call
+// through the dictionary (see printProfile). Core words that runCode does
+// inline, and code made by jitCode and transpileCode, aren't counted.
+#ifndef COMSCRIPT_PROFILE
+#define COMSCRIPT_PROFILE 0
+#endif /* COMSCRIPT_PROFILE */
+
+// Maximum nesting of words that the profiler keeps apart
+#ifndef PROFILE_DEPTH
+#define PROFILE_DEPTH 64
+#endif /* PROFILE_DEPTH */
+
+// Support recording trace events for the words called through the dictionary
+// (see traceStart), which costs a branch per call when it isn't recording.
+#ifndef COMSCRIPT_TRACE
+#define COMSCRIPT_TRACE 1
+#endif /* COMSCRIPT_TRACE */
+
+// Execution engine for runCode: direct-threaded dispatch using computed goto
+// (GCC labels-as-values) when 1, or a switch statement when 0.
+#ifndef COMSCRIPT_THREADED
+#ifdef __GNUC__
+#define COMSCRIPT_THREADED 1
+#else
+#define COMSCRIPT_THREADED 0
+#endif
+#endif /* COMSCRIPT_THREADED */
+
 #define ERROR_STACK_OVERFLOW  1
 #define ERROR_STACK_UNDERFLOW 2
 #define ERROR_WORD_NAME       3
+#define ERROR_COMPILE         4
+#define ERROR_UNVERIFIED      5
+#define ERROR_JIT             6
+#define ERROR_READ            7
+
+// Word flags
+#define WORD_DYNAMIC 1 // stack effect depends on the values on the stack
+#define WORD_PARSING 2 // moves prog, such as to skip over text
+
+// Compiled instruction opcodes
+enum
+{
+	OP_WORD,    // call dict->words[arg]
+	OP_CALL,    // run the body of dict->words[arg], which was defined by the script
+	OP_NUMBER,  // push arg
+	OP_QUOTE,   // push arg, the ID of a quote in dict->quotes
+	OP_UNKNOWN, // unknown word, which is an error if it is reached
+	OP_END,     // end of the code
+	// Control flow, with offsets from the instruction resolved by compileScript
+	OP_BRANCH,      // jump by arg
+	OP_BRANCH_ZERO, // pop a flag, and jump by arg if it is 0
+	OP_FOR,         // pop a count and start a loop, or jump by arg if it is not positive
+	OP_NEXT,        // count the loop, and jump back by arg if it isn't done
+	OP_INDEX,       // push the index of the loop arg levels out from the innermost
+	// Core words, executed inline instead of calling their functions
+	OP_ADD,
+	OP_SUBTRACT,
+	OP_MULTIPLY,
+	OP_DIVIDE,
+	OP_DROP,
+	OP_DUP,
+	OP_SWAP,
+	OP_OVER,
+	OP_NIP,
+	// Superinstructions made by fuseCode. Each replaces the first of a pair
+	// of instructions and skips the second, which is left unchanged.
+	OP_OVER_OVER,       // over over
+	OP_DUP_MULTIPLY,    // dup *
+	OP_SWAP_DROP,       // swap drop
+	OP_DROP_DROP,       // drop drop
+	OP_NUMBER_NUMBER,   // n n
+	OP_NUMBER_ADD,      // n +
+	OP_NUMBER_SUBTRACT, // n -
+	OP_NUMBER_MULTIPLY, // n *
+	OP_COUNT,   // number of opcodes
+};
 
 // Word lookup entry
 struct WordLookup
@@ -17,6 +131,41 @@ struct WordLookup
 	void (*func)(void); // function to call to execute it
 	int numInputs; // number of word's inputs from stack
 	int numOutputs; // number of word's outputs to stack
+	int flags; // WORD_ flags
+	const char *cname; // name of func in C, for transpileCode
+	struct Code *body; // compiled body of a word defined with `: name ... ;`
+};
+
+// Initializer for a built-in word in a table of struct WordLookup
+#define WORD_ENTRY(len, name, func, numInputs, numOutputs, flags, cname) \
+	{ len, name, func, numInputs, numOutputs, flags, cname, NULL }
+
+// Bump allocator for the quotes and words that scripts define, which are
+// all freed at once
+struct Arena
+{
+	struct ArenaBlock *blocks; // newest first
+	long used; // bytes allocated
+	long reserved; // bytes in all the blocks
+	long peak; // most bytes allocated at once
+};
+
+// Memory use of an arena
+struct ArenaStats
+{
+	long used; // bytes allocated
+	long reserved; // bytes in all the blocks
+	long peak; // most bytes allocated at once, which a reset doesn't clear
+	int blocks; // number of blocks
+};
+
+// Quote literal. Every `[ ... ]` with the same text shares one.
+struct Quote
+{
+	int len; // length of the text
+	char *text; // copy of the text between the brackets
+	int dictLen; // dictionary length when it was compiled
+	struct Code *code; // compiled body
 };
 
 // Word dictionary
@@ -24,13 +173,119 @@ struct WordDict
 {
 	int len; // length of the words array
 	struct WordLookup *words; // array of word-lookups
+	int hashCap; // size of the hash array, a power of 2 (0 if not indexed)
+	int *hash; // optional hash index: dictionary index + 1, or 0 for empty
+	int cap; // allocated length of words, or 0 if the array isn't owned by the dictionary
+	int numQuotes; // length of the quotes array
+	int quotesCap; // allocated length of the quotes array
+	struct Quote *quotes; // quote table, indexed by quote ID
+	struct Arena arena; // memory for the quotes and the words defined by scripts
+};
+
+// Compiled instruction
+struct Instr
+{
+	int op;  // opcode
+	int arg; // dictionary index or number
+	int pos; // offset of the word in the source text
+};
+
+// Compiled script
+struct Code
+{
+	int len; // length of the instrs array
+	int cap; // allocated length of the instrs array, or 0 if it isn't owned
+	struct Instr *instrs; // array of instructions
+	int srcLen; // length of the source text
+	const char *src; // source text that was compiled
+	int verified; // whether verifyCode found the stack effects
+	int need; // verified number of stack items needed to run
+	int grow; // verified maximum growth of the stack
+	int net; // verified change in the depth of the stack
+	void *jit; // machine code made by jitCode, which runCode uses instead
+	int jitSize; // size of the jit memory
+	void *map; // file mapped by loadCode, which holds the instrs
+	long mapSize; // size of the file mapping
+};
+
+// Profile of one word. Inclusive time includes the words it runs, such as
+// the words in a quote run by `do`, and exclusive time doesn't.
+struct WordProfile
+{
+	long long calls;
+	long long inclusive;
+	long long exclusive;
+};
+
+// A word that ran, for writeTrace
+struct TraceEvent
+{
+	int word; // dictionary index
+	long long start; // nanoseconds since traceStart
+	long long dur; // nanoseconds
+};
+
+// Ring buffer of trace events, which keeps the latest ones
+struct Trace
+{
+	struct TraceEvent *events;
+	int cap; // length of the events array
+	long long count; // number of events recorded
+	long long minDur; // only record words that take at least this many nanoseconds
+	long long origin; // clock at traceStart
 };
 
-const char *prog;
-int dstack[DATA_STACK_SZ]; // Data stack
-int dI; // Data stack index
+// Interpreter state. Each thread can run its own interpreter.
+struct ComInterp
+{
+	int stack[DATA_STACK_SZ]; // data stack
+	int sp; // data stack index
+	const char *cursor; // position in the program text
+	struct WordDict *dict; // dictionary of words
+	struct Trace *trace; // trace events being recorded, or NULL
+#if COMSCRIPT_PROFILE
+	struct WordProfile *profile; // indexed by dictionary index
+	int profileLen; // length of the profile array
+	int profileDepth; // number of words being timed
+	long long profileChild[PROFILE_DEPTH]; // time in the words called by each word being timed
+#endif
+};
+
+// The interpreter that is running on this thread. Words written in C use the
+// global names below, which refer to it (like errno does).
+extern _Thread_local struct ComInterp *comCurrent;
+extern struct ComInterp comDefault; // the interpreter used by the global API
+
+#define dstack (comCurrent->stack) // Data stack
+#define dI (comCurrent->sp)        // Data stack index
+#define prog (comCurrent->cursor)  // Position in the program text
+
+void comInit(struct ComInterp *ci, struct WordDict *dict); // Initialize an interpreter with an empty stack.
+int comRunScript(struct ComInterp *ci, int len, const char *str); // runScript with an interpreter
+int comRunCode(struct ComInterp *ci, struct Code *code); // runCode with an interpreter
+int comRunStream(struct ComInterp *ci, int fd); // runStream with an interpreter
+void comPush(struct ComInterp *ci, int n); // dpush with an interpreter
+int comPop(struct ComInterp *ci); // dpop with an interpreter
+int comPick(struct ComInterp *ci, int n); // dpick with an interpreter
+void printProfile(FILE *fp, struct ComInterp *ci, int csv); // Print the words by exclusive time, as a table or CSV
+void freeProfile(struct ComInterp *ci); // Free and clear the profile
+int traceStart(struct ComInterp *ci, int cap, long long minDur); // Record up to cap of the latest words that take at least minDur ns, returns 0 on success
+void writeTrace(FILE *fp, struct ComInterp *ci); // Write the recorded words as Chrome trace event JSON
+void traceStop(struct ComInterp *ci); // Stop recording and free the events
 
 int runScript(int len, const char *str, struct WordDict *dict); // Interpret the str as a list of words and execute them.
+int compileScript(int len, const char *str, struct WordDict *dict, struct Code *code); // Compile the str into code.
+int runCode(struct Code *code, struct WordDict *dict); // Execute compiled code.
+int runStream(int fd, struct WordDict *dict); // Read, compile and execute words from a file descriptor as they arrive.
+void freeCode(struct Code *code); // Free the instructions of compiled code.
+int verifyCode(struct Code *code, struct WordDict *dict); // Check stack effects so that code can run without per-word checks.
+int fuseCode(struct Code *code); // Replace common pairs of instructions with superinstructions, returns the number replaced.
+void printFusions(FILE *fp, struct Code *code, struct WordDict *dict); // Print the superinstructions in code, and in the words and quotes that dict has defined.
+int transpileCode(FILE *fp, const char *name, struct Code *code, struct WordDict *dict); // Write verifiable code as a C function.
+int jitCode(struct Code *code, struct WordDict *dict); // Compile verifiable code to machine code, returns 0 on success.
+int saveCode(const char *path, struct Code *code, struct WordDict *dict); // Write compiled code and the words and quotes it defined to a file, returns 0 on success.
+int loadCode(const char *path, int len, const char *str, struct WordDict *dict, struct Code *code); // Map code saved for str and dict, returns 0 on success. Like compileScript, it doesn't verify the code.
+unsigned long long hashText(int len, const char *str); // 64-bit hash of text, such as to name saved code
 
 const char *errMessage(int code); // convert runScript error code to message
 
@@ -41,6 +296,13 @@ int dpick(int n);  // Pick the Nth item on the stack (starting at 0)
 void dreset(void); // Reset stack to empty.
 
 int find(struct WordDict *dict, int wordLen, const char *word); // Return an index into dict or negative if not found
+int addWord(struct WordDict *dict, const struct WordLookup *w); // Append a word to dict, returns its index or negative if out of memory
+int indexDict(struct WordDict *dict); // Build the hash index used by find, returns 0 if out of memory
+void freeDictIndex(struct WordDict *dict); // Free the hash index
+void resetDict(struct WordDict *dict); // Remove the words and quotes defined by scripts, and free their memory
+void *arenaAlloc(struct Arena *arena, long size); // Allocate from an arena, returns NULL if out of memory
+void arenaFree(struct Arena *arena); // Free everything allocated from an arena
+struct ArenaStats arenaStats(struct Arena *arena); // Memory use of an arena
 int number(int len, const char *str);
 void word(const char *in, const char **start, int *len);
 
@@ -62,10 +324,298 @@ void nip(void);       // Stack effect: ( x y -- y ),    WordEntry: { 3, "nip",
 #include <ctype.h>
 #include <assert.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+
+struct ComInterp comDefault;
+_Thread_local struct ComInterp *comCurrent = &comDefault;
+
+void comInit(struct ComInterp *ci, struct WordDict *dict)
+{
+	ci->sp = 0;
+	ci->cursor = NULL;
+	ci->dict = dict;
+	ci->trace = NULL;
+#if COMSCRIPT_PROFILE
+	ci->profile = NULL;
+	ci->profileLen = 0;
+	ci->profileDepth = 0;
+#endif
+}
+
+void comPush(struct ComInterp *ci, int n)
+{
+	assert(ci->sp < DATA_STACK_SZ);
+	ci->stack[ci->sp] = n;
+	ci->sp++;
+}
+
+int comPop(struct ComInterp *ci)
+{
+	assert(ci->sp > 0);
+	ci->sp--;
+	return ci->stack[ci->sp];
+}
+
+int comPick(struct ComInterp *ci, int n)
+{
+	assert(ci->sp > n);
+	return ci->stack[ci->sp - n - 1];
+}
+
+static long long traceClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// The events are allocated up front, so recording one doesn't allocate.
+int traceStart(struct ComInterp *ci, int cap, long long minDur)
+{
+	traceStop(ci);
+	if (cap <= 0)
+	{
+		return 1;
+	}
+	struct Trace *t = malloc(sizeof(*t));
+	if (!t)
+	{
+		return 1;
+	}
+	t->events = malloc(cap * sizeof(*t->events));
+	if (!t->events)
+	{
+		free(t);
+		return 1;
+	}
+	t->cap = cap;
+	t->count = 0;
+	t->minDur = minDur;
+	t->origin = traceClock();
+	ci->trace = t;
+	return 0;
+}
+
+void traceStop(struct ComInterp *ci)
+{
+	if (ci->trace)
+	{
+		free(ci->trace->events);
+		free(ci->trace);
+		ci->trace = NULL;
+	}
+}
+
+// Each word is written as a complete ("X") event, which holds both its begin
+// and end, since a word is only recorded once it is known to be long enough.
+void writeTrace(FILE *fp, struct ComInterp *ci)
+{
+	struct Trace *t = ci->trace;
+	long long first = 0;
+	long long n = 0;
+	if (t)
+	{
+		first = (t->count > t->cap)? t->count - t->cap : 0;
+		n = t->count - first;
+	}
+	fprintf(fp, "{\"traceEvents\":[");
+	for (long long k = 0; k < n; k++)
+	{
+		struct TraceEvent *e = &t->events[(first + k) % t->cap];
+		fprintf(fp, "%s\n{\"name\":\"", k? "," : "");
+		if (e->word < ci->dict->len)
+		{
+			struct WordLookup *w = &ci->dict->words[e->word];
+			for (int c = 0; c < w->len; c++)
+			{
+				if (w->name[c] == '"' || w->name[c] == '\\')
+				{
+					fputc('\\', fp);
+				}
+				fputc(w->name[c], fp);
+			}
+		}
+		fprintf(fp, "\",\"cat\":\"word\",\"ph\":\"X\",\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,\"pid\":1,\"tid\":1}",
+				e->start / 1000, e->start % 1000, e->dur / 1000, e->dur % 1000);
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%lld}}\n", first);
+}
+
+#if COMSCRIPT_TRACE
+
+// Record dictionary word i, which started at the clock start
+static void traceRecord(struct ComInterp *ci, int i, long long start)
+{
+	struct Trace *t = ci->trace;
+	long long dur = traceClock() - start;
+	if (dur < t->minDur)
+	{
+		return;
+	}
+	struct TraceEvent *e = &t->events[t->count % t->cap];
+	e->word = i;
+	e->start = start - t->origin;
+	e->dur = dur;
+	t->count++;
+}
+
+#define TRACE_ENTER(ci) long long traceBegin = (ci)->trace? traceClock() : 0
+#define TRACE_EXIT(ci, i) do { if ((ci)->trace) { traceRecord(ci, i, traceBegin); } } while (0)
+#else
+#define TRACE_ENTER(ci) do { } while (0)
+#define TRACE_EXIT(ci, i) do { } while (0)
+#endif
+
+#if COMSCRIPT_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_UNIT "cycles"
+static long long profileClock(void)
+{
+	return __rdtsc();
+}
+#else
+#define PROFILE_UNIT "ns"
+static long long profileClock(void)
+{
+	return traceClock();
+}
+#endif
+
+// Start timing a word, returns the start time
+static long long profileEnter(struct ComInterp *ci)
+{
+	if (ci->profileDepth < PROFILE_DEPTH)
+	{
+		ci->profileChild[ci->profileDepth] = 0;
+	}
+	ci->profileDepth++;
+	return profileClock();
+}
+
+// Stop timing dictionary word i, which started at start
+static void profileExit(struct ComInterp *ci, int i, long long start)
+{
+	long long t = profileClock() - start;
+	ci->profileDepth--;
+	int d = ci->profileDepth;
+	if (i >= ci->profileLen)
+	{
+		int len = ci->dict->len > i? ci->dict->len : i + 1;
+		struct WordProfile *profile = realloc(ci->profile, len * sizeof(*profile));
+		if (!profile)
+		{
+			return;
+		}
+		memset(profile + ci->profileLen, 0, (len - ci->profileLen) * sizeof(*profile));
+		ci->profile = profile;
+		ci->profileLen = len;
+	}
+	struct WordProfile *p = &ci->profile[i];
+	p->calls++;
+	p->inclusive += t;
+	p->exclusive += t - ((d < PROFILE_DEPTH)? ci->profileChild[d] : 0);
+	if (d > 0 && d - 1 < PROFILE_DEPTH)
+	{
+		ci->profileChild[d - 1] += t;
+	}
+}
+
+#define PROFILE_ENTER(ci) long long profileStart = profileEnter(ci)
+#define PROFILE_EXIT(ci, i) profileExit(ci, i, profileStart)
+
+static struct WordProfile *sortProfile;
+
+static int compareProfile(const void *a, const void *b)
+{
+	long long x = sortProfile[*(const int *)a].exclusive;
+	long long y = sortProfile[*(const int *)b].exclusive;
+	return (x < y) - (x > y);
+}
+
+void printProfile(FILE *fp, struct ComInterp *ci, int csv)
+{
+	int *order = malloc(ci->profileLen * sizeof(*order) + 1);
+	if (!order)
+	{
+		return;
+	}
+	int n = 0;
+	for (int i = 0; i < ci->profileLen && i < ci->dict->len; i++)
+	{
+		if (ci->profile[i].calls)
+		{
+			order[n++] = i;
+		}
+	}
+	sortProfile = ci->profile;
+	qsort(order, n, sizeof(*order), compareProfile);
+
+	if (csv)
+	{
+		fprintf(fp, "word,calls,inclusive_%s,exclusive_%s\n", PROFILE_UNIT, PROFILE_UNIT);
+	}
+	else
+	{
+		fprintf(fp, "%-12s %12s %16s %16s %12s\n", "word", "calls", "inclusive", "exclusive", "per call");
+	}
+	for (int k = 0; k < n; k++)
+	{
+		struct WordLookup *w = &ci->dict->words[order[k]];
+		struct WordProfile *p = &ci->profile[order[k]];
+		if (csv)
+		{
+			fprintf(fp, "\"%.*s\",%lld,%lld,%lld\n", w->len, w->name, p->calls, p->inclusive, p->exclusive);
+		}
+		else
+		{
+			fprintf(fp, "%-12.*s %12lld %16lld %16lld %12lld\n", w->len, w->name,
+					p->calls, p->inclusive, p->exclusive, p->exclusive / p->calls);
+		}
+	}
+	if (!csv)
+	{
+		fprintf(fp, "(times in %s)\n", PROFILE_UNIT);
+	}
+	free(order);
+}
+
+void freeProfile(struct ComInterp *ci)
+{
+	free(ci->profile);
+	ci->profile = NULL;
+	ci->profileLen = 0;
+	ci->profileDepth = 0;
+}
+
+#else
+
+#define PROFILE_ENTER(ci) do { } while (0)
+#define PROFILE_EXIT(ci, i) do { } while (0)
+
+void printProfile(FILE *fp, struct ComInterp *ci, int csv)
+{
+	(void)fp;
+	(void)ci;
+	(void)csv;
+}
+
+void freeProfile(struct ComInterp *ci)
+{
+	(void)ci;
+}
 
-// data stack and index
-int dstack[DATA_STACK_SZ];
-int dI = 0;
+#endif /* COMSCRIPT_PROFILE */
+
+// Hooks around every word called through the dictionary
+#define WORD_ENTER(ci) PROFILE_ENTER(ci); TRACE_ENTER(ci)
+#define WORD_EXIT(ci, i) TRACE_EXIT(ci, i); PROFILE_EXIT(ci, i)
 
 int dtop(void)
 {
@@ -74,22 +624,22 @@ int dtop(void)
 
 void dpush(int n)
 {
-	assert(dI < DATA_STACK_SZ);
-	dstack[dI] = n;
-	dI++;
+	comPush(comCurrent, n);
 }
 
 int dpop(void)
 {
-	assert(dI > 0);
-	dI--;
-	return dstack[dI];
+	return comPop(comCurrent);
+}
+
+void dreset(void)
+{
+	dI = 0;
 }
 
 int dpick(int n)
 {
-	assert(dI > n);
-	return dstack[dI - n - 1];
+	return comPick(comCurrent, n);
 }
 
 int number(int len, const char *str)
@@ -193,6 +743,17 @@ void nip(void)
 	dpush(x);
 }
 
+// FNV-1a hash of a word name
+static unsigned hashWord(int len, const char *word)
+{
+	unsigned h = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)word[i]) * 16777619u;
+	}
+	return h;
+}
+
 // Returns index into words, or -1 if not found.
 int find(struct WordDict *dict, int wordLen, const char *word)
 {
@@ -201,6 +762,24 @@ int find(struct WordDict *dict, int wordLen, const char *word)
 		return -1;
 	}
 
+	if (dict->hash)
+	{
+		// Open addressing with linear probing
+		unsigned mask = dict->hashCap - 1;
+		unsigned h = hashWord(wordLen, word) & mask;
+		while (dict->hash[h])
+		{
+			int i = dict->hash[h] - 1;
+			struct WordLookup *record = &dict->words[i];
+			if (record->len == wordLen && streq(record->name, word, wordLen))
+			{
+				return i;
+			}
+			h = (h + 1) & mask;
+		}
+		return -1;
+	}
+
 	for (int i = 0; i < dict->len; i++)
 	{
 		struct WordLookup record = dict->words[i];
@@ -217,81 +796,2516 @@ int find(struct WordDict *dict, int wordLen, const char *word)
 	return -1;
 }
 
-int runScript(int len, const char *str, struct WordDict *dict)
+// Insert dictionary index i into the hash index, unless an earlier word has
+// the same name (so that find gives the same result as the linear search).
+static void hashInsert(struct WordDict *dict, int i)
 {
-	prog = str;
-	const char *wstart = NULL; // word start
-	int wlen = 0; // word length
-	while (1)
+	struct WordLookup *w = &dict->words[i];
+	unsigned mask = dict->hashCap - 1;
+	unsigned h = hashWord(w->len, w->name) & mask;
+	while (dict->hash[h])
 	{
-		// Reached end of program?
-		if (prog - str >= len)
+		struct WordLookup *other = &dict->words[dict->hash[h] - 1];
+		if (other->len == w->len && streq(other->name, w->name, w->len))
 		{
-			break;
+			return;
 		}
+		h = (h + 1) & mask;
+	}
+	dict->hash[h] = i + 1;
+}
 
-		// Read a word from the program string;
-		word(prog, &wstart, &wlen);
-		if (!wlen || wstart - str >= len)
+int indexDict(struct WordDict *dict)
+{
+	// Keep the load factor at or below 1/2
+	int cap = 16;
+	while (cap < dict->len * 2)
+	{
+		cap *= 2;
+	}
+	int *hash = calloc(cap, sizeof(*hash));
+	if (!hash)
+	{
+		return 0;
+	}
+	free(dict->hash);
+	dict->hash = hash;
+	dict->hashCap = cap;
+	for (int i = 0; i < dict->len; i++)
+	{
+		hashInsert(dict, i);
+	}
+	return 1;
+}
+
+void freeDictIndex(struct WordDict *dict)
+{
+	free(dict->hash);
+	dict->hash = NULL;
+	dict->hashCap = 0;
+}
+
+// The words array is copied the first time if the dictionary doesn't own it,
+// such as when it is a static array.
+int addWord(struct WordDict *dict, const struct WordLookup *w)
+{
+	if (dict->len >= dict->cap)
+	{
+		int cap = dict->cap? dict->cap * 2 : dict->len * 2 + 16;
+		struct WordLookup *words = malloc(cap * sizeof(*words));
+		if (!words)
 		{
-			// End of input
-			break;
+			return -1;
 		}
-
-		// Lookup the word.
-		int i = find(dict, wlen, wstart);
-		if (i >= 0)
+		memcpy(words, dict->words, dict->len * sizeof(*words));
+		if (dict->cap)
 		{
-			// Found the word in the list. Try to execute it.
-			struct WordLookup w = dict->words[i];
-			// Check number of arguments on the stack
-			if (w.numInputs > dI)
-			{
-				// Not enough values on stack
-				return ERROR_STACK_UNDERFLOW;
-			}
-			else if (w.numOutputs - w.numInputs > DATA_STACK_SZ - dI)
-			{
-				// Too many values on the stack
-				return ERROR_STACK_OVERFLOW;
-			}
-			else
-			{
-				// Execute it.
-				const char *save_prog = prog;
-				w.func();
-				// If the function modified the prog pointer,
-				// then skip the part of the outer while loop
-				// where prog is changed the end next word.
-				if (prog != save_prog)
-				{
-					continue;
-				}
-			}
+			free(dict->words);
 		}
-		else if (isdigit(*wstart))
+		dict->words = words;
+		dict->cap = cap;
+	}
+	int i = dict->len++;
+	dict->words[i] = *w;
+	if (dict->hash)
+	{
+		if (dict->len * 2 > dict->hashCap)
 		{
-			// Number.
-			if (dI < DATA_STACK_SZ)
-			{
-				dpush(number(wlen, wstart));
-			}
-			else
+			if (!indexDict(dict))
 			{
-				// too many items on stack
-				return ERROR_STACK_OVERFLOW;
+				dict->len--;
+				return -1;
 			}
 		}
 		else
 		{
-			// unknown word
-			return ERROR_WORD_NAME;
+			hashInsert(dict, i);
 		}
+	}
+	return i;
+}
 
-		// Next word in program string.
-		prog = wstart + wlen;
+// Block of arena memory
+struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	long size; // bytes in data
+	long used; // bytes of data allocated
+	_Alignas(16) char data[];
+};
+
+void *arenaAlloc(struct Arena *arena, long size)
+{
+	size = (size + 15) & ~15L;
+	struct ArenaBlock *b = arena->blocks;
+	if (!b || b->used + size > b->size)
+	{
+		// Large allocations get a block of their own
+		long blockSize = (size > ARENA_BLOCK_SZ)? size : ARENA_BLOCK_SZ;
+		b = malloc(sizeof(*b) + blockSize);
+		if (!b)
+		{
+			return NULL;
+		}
+		b->size = blockSize;
+		b->used = 0;
+		b->next = arena->blocks;
+		arena->blocks = b;
+		arena->reserved += blockSize;
 	}
-	return 0;
+	void *p = b->data + b->used;
+	b->used += size;
+	arena->used += size;
+	if (arena->used > arena->peak)
+	{
+		arena->peak = arena->used;
+	}
+	return p;
+}
+
+void arenaFree(struct Arena *arena)
+{
+	struct ArenaBlock *b = arena->blocks;
+	while (b)
+	{
+		struct ArenaBlock *next = b->next;
+		free(b);
+		b = next;
+	}
+	arena->blocks = NULL;
+	arena->used = 0;
+	arena->reserved = 0;
+}
+
+struct ArenaStats arenaStats(struct Arena *arena)
+{
+	struct ArenaStats stats = { arena->used, arena->reserved, arena->peak, 0 };
+	for (struct ArenaBlock *b = arena->blocks; b; b = b->next)
+	{
+		stats.blocks++;
+	}
+	return stats;
+}
+
+// Move the instructions of compiled code into the arena
+static int arenaCode(struct Arena *arena, struct Code *code)
+{
+	struct Instr *instrs = arenaAlloc(arena, code->len * sizeof(*instrs));
+	if (!instrs)
+	{
+		return 0;
+	}
+	memcpy(instrs, code->instrs, code->len * sizeof(*instrs));
+	free(code->instrs);
+	code->instrs = instrs;
+	code->cap = 0;
+	return 1;
+}
+
+// Code that isn't owned by the arena, such as JIT memory, is freed first.
+void resetDict(struct WordDict *dict)
+{
+	int len = dict->len;
+	for (int i = 0; i < dict->len; i++)
+	{
+		if (dict->words[i].body)
+		{
+			freeCode(dict->words[i].body);
+			if (i < len)
+			{
+				// Words defined by scripts come after the rest
+				len = i;
+			}
+		}
+	}
+	for (int q = 0; q < dict->numQuotes; q++)
+	{
+		freeCode(dict->quotes[q].code);
+	}
+	free(dict->quotes);
+	dict->quotes = NULL;
+	dict->numQuotes = 0;
+	dict->quotesCap = 0;
+	arenaFree(&dict->arena);
+	if (len != dict->len)
+	{
+		dict->len = len;
+		if (dict->hash)
+		{
+			indexDict(dict);
+		}
+	}
+}
+
+static int execCode(struct ComInterp *ci, struct Code *code);
+static int defineWord(struct WordDict *dict, int len, const char *str);
+static int matchBracket(int len, const char *str);
+static int addQuote(struct WordDict *dict, int len, const char *text);
+
+static int interpretText(struct ComInterp *ci, int len, const char *str)
+{
+	struct WordDict *dict = ci->dict;
+	ci->cursor = str;
+	const char *wstart = NULL; // word start
+	int wlen = 0; // word length
+	while (1)
+	{
+		// Reached end of program?
+		if (ci->cursor - str >= len)
+		{
+			break;
+		}
+
+		// Read a word from the program string;
+		word(ci->cursor, &wstart, &wlen);
+		if (!wlen || wstart - str >= len)
+		{
+			// End of input
+			break;
+		}
+
+		if (wlen == 1 && *wstart == ':')
+		{
+			int n = defineWord(dict, len - (wstart - str), wstart);
+			if (!n)
+			{
+				return ERROR_COMPILE;
+			}
+			ci->cursor = wstart + n;
+			continue;
+		}
+
+		if (wlen == 1 && *wstart == '[')
+		{
+			int end = matchBracket(len - (wstart - str), wstart);
+			int id = (end < 0)? -1 : addQuote(dict, end - 1, wstart + 1);
+			if (id < 0)
+			{
+				return ERROR_COMPILE;
+			}
+			if (ci->sp >= DATA_STACK_SZ)
+			{
+				return ERROR_STACK_OVERFLOW;
+			}
+			comPush(ci, id);
+			ci->cursor = wstart + end + 1;
+			continue;
+		}
+
+		// Lookup the word.
+		int i = find(dict, wlen, wstart);
+		if (i >= 0)
+		{
+			// Found the word in the list. Try to execute it.
+			struct WordLookup *w = &dict->words[i];
+			// Check number of arguments on the stack
+			if (w->numInputs > ci->sp)
+			{
+				// Not enough values on stack
+				return ERROR_STACK_UNDERFLOW;
+			}
+			else if (w->numOutputs - w->numInputs > DATA_STACK_SZ - ci->sp)
+			{
+				// Too many values on the stack
+				return ERROR_STACK_OVERFLOW;
+			}
+			else if (w->body)
+			{
+				// Defined by the script
+				WORD_ENTER(ci);
+				int err = execCode(ci, w->body);
+				WORD_EXIT(ci, i);
+				if (err)
+				{
+					return err;
+				}
+			}
+			else
+			{
+				// Execute it.
+				const char *save_prog = ci->cursor;
+				WORD_ENTER(ci);
+				w->func();
+				WORD_EXIT(ci, i);
+				// If the function modified the prog pointer,
+				// then skip the part of the outer while loop
+				// where prog is changed the end next word.
+				if (ci->cursor != save_prog)
+				{
+					continue;
+				}
+			}
+		}
+		else if (isdigit(*wstart))
+		{
+			// Number.
+			if (ci->sp < DATA_STACK_SZ)
+			{
+				comPush(ci, number(wlen, wstart));
+			}
+			else
+			{
+				// too many items on stack
+				return ERROR_STACK_OVERFLOW;
+			}
+		}
+		else
+		{
+			// unknown word
+			return ERROR_WORD_NAME;
+		}
+
+		// Next word in program string.
+		ci->cursor = wstart + wlen;
+	}
+	return 0;
+}
+
+// Run with ci as the current interpreter for the words written in C.
+int comRunScript(struct ComInterp *ci, int len, const char *str)
+{
+	struct ComInterp *save = comCurrent;
+	comCurrent = ci;
+	int err = interpretText(ci, len, str);
+	comCurrent = save;
+	return err;
+}
+
+int runScript(int len, const char *str, struct WordDict *dict)
+{
+	comCurrent->dict = dict;
+	return comRunScript(comCurrent, len, str);
+}
+
+// Append an instruction to code, returns 0 if out of memory.
+static int emitInstr(struct Code *code, int op, int arg, int pos)
+{
+	if (code->len >= code->cap)
+	{
+		int cap = code->cap? code->cap * 2 : 64;
+		struct Instr *instrs = realloc(code->instrs, cap * sizeof(*instrs));
+		if (!instrs)
+		{
+			return 0;
+		}
+		code->instrs = instrs;
+		code->cap = cap;
+	}
+	struct Instr *in = &code->instrs[code->len++];
+	in->op = op;
+	in->arg = arg;
+	in->pos = pos;
+	return 1;
+}
+
+// Core words which runCode executes inline
+static const struct
+{
+	void (*func)(void);
+	int op;
+} coreOps[] =
+{
+	{ add,       OP_ADD },
+	{ subtract,  OP_SUBTRACT },
+	{ multiply,  OP_MULTIPLY },
+	{ divide,    OP_DIVIDE },
+	{ drop,      OP_DROP },
+	{ duplicate, OP_DUP },
+	{ swap,      OP_SWAP },
+	{ over,      OP_OVER },
+	{ nip,       OP_NIP },
+};
+
+// Return the opcode for a word's function.
+static int coreOp(void (*func)(void))
+{
+	for (int i = 0; i < (int)(sizeof(coreOps)/sizeof(coreOps[0])); i++)
+	{
+		if (coreOps[i].func == func)
+		{
+			return coreOps[i].op;
+		}
+	}
+	return OP_WORD;
+}
+
+// Return the offset of the ']' that matches the '[' at the start of str, or
+// -1 if there isn't one.
+static int matchBracket(int len, const char *str)
+{
+	int depth = 0;
+	int i = 0;
+	while (i < len && str[i])
+	{
+		int wpos = i;
+		while (i < len && str[i] && !isspace(str[i]))
+		{
+			i++;
+		}
+		if (i - wpos == 1 && str[wpos] == '[')
+		{
+			depth++;
+		}
+		else if (i - wpos == 1 && str[wpos] == ']' && !--depth)
+		{
+			return wpos;
+		}
+		while (i < len && str[i] && isspace(str[i]))
+		{
+			i++;
+		}
+	}
+	return -1;
+}
+
+// Add a quote to the end of the quote table, and return its ID or -1 if out
+// of memory
+static int appendQuote(struct WordDict *dict, const struct Quote *q)
+{
+	if (dict->numQuotes >= dict->quotesCap)
+	{
+		int cap = dict->quotesCap? dict->quotesCap * 2 : 16;
+		struct Quote *quotes = realloc(dict->quotes, cap * sizeof(*quotes));
+		if (!quotes)
+		{
+			return -1;
+		}
+		dict->quotes = quotes;
+		dict->quotesCap = cap;
+	}
+	dict->quotes[dict->numQuotes] = *q;
+	return dict->numQuotes++;
+}
+
+// Return the ID of the quote with the text, compiling it and adding it to the
+// quote table if it isn't there yet. Returns -1 if it doesn't compile.
+static int addQuote(struct WordDict *dict, int len, const char *text)
+{
+	// Words defined since an earlier copy was compiled could change it
+	for (int q = 0; q < dict->numQuotes; q++)
+	{
+		struct Quote *p = &dict->quotes[q];
+		if (p->len == len && p->dictLen == dict->len && !memcmp(p->text, text, len))
+		{
+			return q;
+		}
+	}
+
+	// The arena memory of a quote that fails is freed with the rest
+	struct Quote new = {0};
+	new.len = len;
+	new.text = arenaAlloc(&dict->arena, len + 1);
+	new.code = arenaAlloc(&dict->arena, sizeof(*new.code));
+	if (!new.text || !new.code)
+	{
+		return -1;
+	}
+	memcpy(new.text, text, len);
+	new.text[len] = 0;
+	new.dictLen = dict->len;
+	memset(new.code, 0, sizeof(*new.code));
+	if (compileScript(len, new.text, dict, new.code))
+	{
+		freeCode(new.code);
+		return -1;
+	}
+	fuseCode(new.code);
+	verifyCode(new.code, dict);
+	if (!arenaCode(&dict->arena, new.code))
+	{
+		freeCode(new.code);
+		return -1;
+	}
+	return appendQuote(dict, &new);
+}
+
+// Words that compileScript handles itself
+enum
+{
+	CTL_IF,
+	CTL_ELSE,
+	CTL_THEN,
+	CTL_BEGIN,
+	CTL_UNTIL,
+	CTL_FOR,
+	CTL_NEXT,
+	CTL_I,
+	CTL_J,
+};
+
+static const char *const controlWords[] =
+{
+	[CTL_IF]      = "if",
+	[CTL_ELSE]    = "else",
+	[CTL_THEN]    = "then",
+	[CTL_BEGIN]   = "begin",
+	[CTL_UNTIL]   = "until",
+	[CTL_FOR]     = "for",
+	[CTL_NEXT]    = "next",
+	[CTL_I]       = "i",
+	[CTL_J]       = "j",
+};
+
+// An open control structure
+struct Control
+{
+	int word; // CTL_ word that opened it
+	int at; // index of its instruction
+};
+
+static int controlWord(int len, const char *word)
+{
+	for (int c = 0; c < (int)(sizeof(controlWords)/sizeof(controlWords[0])); c++)
+	{
+		if ((int)strlen(controlWords[c]) == len && streq(controlWords[c], word, len))
+		{
+			return c;
+		}
+	}
+	return -1;
+}
+
+// Compile a control word, resolving the branch offsets of the structure it
+// closes. Returns 0 if it doesn't match the open structures.
+static int compileControl(struct Code *code, int c, int pos, struct Control *ctl, int *numCtl, int *numLoops)
+{
+	struct Control *top = *numCtl? &ctl[*numCtl - 1] : NULL;
+	int here = code->len;
+	switch (c)
+	{
+		case CTL_IF:
+		case CTL_BEGIN:
+		case CTL_FOR:
+			if (*numCtl == CONTROL_DEPTH)
+			{
+				return 0;
+			}
+			ctl[*numCtl].word = c;
+			ctl[*numCtl].at = here;
+			(*numCtl)++;
+			if (c == CTL_FOR)
+			{
+				(*numLoops)++;
+				return emitInstr(code, OP_FOR, 0, pos);
+			}
+			if (c == CTL_IF)
+			{
+				return emitInstr(code, OP_BRANCH_ZERO, 0, pos);
+			}
+			return 1;
+		case CTL_ELSE:
+			if (!top || top->word != CTL_IF)
+			{
+				return 0;
+			}
+			code->instrs[top->at].arg = here + 1 - top->at;
+			top->word = CTL_ELSE;
+			top->at = here;
+			return emitInstr(code, OP_BRANCH, 0, pos);
+		case CTL_THEN:
+			if (!top || (top->word != CTL_IF && top->word != CTL_ELSE))
+			{
+				return 0;
+			}
+			code->instrs[top->at].arg = here - top->at;
+			(*numCtl)--;
+			return 1;
+		case CTL_UNTIL:
+			if (!top || top->word != CTL_BEGIN)
+			{
+				return 0;
+			}
+			(*numCtl)--;
+			return emitInstr(code, OP_BRANCH_ZERO, top->at - here, pos);
+		case CTL_NEXT:
+			if (!top || top->word != CTL_FOR)
+			{
+				return 0;
+			}
+			code->instrs[top->at].arg = here + 1 - top->at;
+			(*numCtl)--;
+			(*numLoops)--;
+			return emitInstr(code, OP_NEXT, top->at + 1 - here, pos);
+		case CTL_I:
+		case CTL_J:
+			if (c - CTL_I >= *numLoops)
+			{
+				return 0;
+			}
+			return emitInstr(code, OP_INDEX, c - CTL_I, pos);
+	}
+	return 0;
+}
+
+// Tokenize and lookup every word in str once, so that runCode doesn't have to.
+// Unknown words are compiled to OP_UNKNOWN and only fail if they are reached,
+// the same as with runScript.
+int compileScript(int len, const char *str, struct WordDict *dict, struct Code *code)
+{
+	code->len = 0;
+	code->verified = 0;
+	code->src = str;
+	code->srcLen = len;
+	struct Control ctl[CONTROL_DEPTH]; // structures that are still open
+	int numCtl = 0;
+	int numLoops = 0; // open for loops
+	int i = 0;
+	while (1)
+	{
+		// Skip whitespace
+		while (i < len && str[i] && isspace(str[i]))
+		{
+			i++;
+		}
+		int wpos = i;
+		// Read non-whitespace
+		while (i < len && str[i] && !isspace(str[i]))
+		{
+			i++;
+		}
+		int wlen = i - wpos;
+		if (!wlen)
+		{
+			// End of input
+			break;
+		}
+
+		const char *wstart = str + wpos;
+		if (wlen == 1 && *wstart == ':')
+		{
+			// Definitions are compiled now, and leave no instructions
+			int n = defineWord(dict, len - wpos, wstart);
+			if (!n)
+			{
+				return ERROR_COMPILE;
+			}
+			i = wpos + n;
+			continue;
+		}
+
+		int c = controlWord(wlen, wstart);
+		if (c >= 0)
+		{
+			if (!compileControl(code, c, wpos, ctl, &numCtl, &numLoops))
+			{
+				return ERROR_COMPILE;
+			}
+			continue;
+		}
+
+		if (wlen == 1 && *wstart == '[')
+		{
+			// The quote is compiled once into the quote table, and only
+			// pushes its ID
+			int end = matchBracket(len - wpos, wstart);
+			int id = (end < 0)? -1 : addQuote(dict, end - 1, wstart + 1);
+			if (id < 0 || !emitInstr(code, OP_QUOTE, id, wpos))
+			{
+				return ERROR_COMPILE;
+			}
+			i = wpos + end + 1;
+			continue;
+		}
+
+		int op, arg;
+		int w = find(dict, wlen, wstart);
+		if (w >= 0)
+		{
+			op = dict->words[w].body? OP_CALL : coreOp(dict->words[w].func);
+			arg = w;
+		}
+		else if (isdigit(*wstart))
+		{
+			op = OP_NUMBER;
+			arg = number(wlen, wstart);
+		}
+		else
+		{
+			op = OP_UNKNOWN;
+			arg = 0;
+		}
+
+		if (!emitInstr(code, op, arg, wpos))
+		{
+			return ERROR_COMPILE;
+		}
+	}
+	if (numCtl)
+	{
+		return ERROR_COMPILE;
+	}
+	if (!emitInstr(code, OP_END, 0, len))
+	{
+		return ERROR_COMPILE;
+	}
+	return 0;
+}
+
+// Set the stack effect of a defined word from its compiled body
+static void wordEffects(struct WordLookup *w, struct WordDict *dict)
+{
+	if (!verifyCode(w->body, dict))
+	{
+		w->numInputs = w->body->need;
+		w->numOutputs = w->body->need + w->body->net;
+	}
+	else
+	{
+		// Checked by the body as it runs
+		w->flags = WORD_DYNAMIC;
+	}
+}
+
+// Compile the definition `: name ... ;` at the start of str and add it to the
+// dictionary. The body is compiled from a copy of its text, so it can outlive
+// str. Returns the length of the definition, or 0 if it is not valid.
+static int defineWord(struct WordDict *dict, int len, const char *str)
+{
+	// Read the name after the ':'
+	int i = 1;
+	while (i < len && str[i] && isspace(str[i]))
+	{
+		i++;
+	}
+	const char *name = str + i;
+	while (i < len && str[i] && !isspace(str[i]))
+	{
+		i++;
+	}
+	int nameLen = str + i - name;
+	if (!nameLen || find(dict, nameLen, name) >= 0 || controlWord(nameLen, name) >= 0)
+	{
+		// Words can't be defined again
+		return 0;
+	}
+
+	// Find the ';' at the end of the body
+	int bodyStart = i;
+	int bodyLen = -1;
+	while (bodyLen < 0)
+	{
+		while (i < len && str[i] && isspace(str[i]))
+		{
+			i++;
+		}
+		int wpos = i;
+		while (i < len && str[i] && !isspace(str[i]))
+		{
+			i++;
+		}
+		int wlen = i - wpos;
+		if (!wlen || (wlen == 1 && str[wpos] == ':'))
+		{
+			// No ';' or a nested definition
+			return 0;
+		}
+		if (wlen == 1 && str[wpos] == ';')
+		{
+			bodyLen = wpos - bodyStart;
+		}
+	}
+
+	struct WordLookup w = {0};
+	char *copy = arenaAlloc(&dict->arena, nameLen + 1 + bodyLen + 1);
+	w.body = arenaAlloc(&dict->arena, sizeof(*w.body));
+	if (!copy || !w.body)
+	{
+		return 0;
+	}
+	memset(w.body, 0, sizeof(*w.body));
+	memcpy(copy, name, nameLen);
+	copy[nameLen] = 0;
+	char *text = copy + nameLen + 1;
+	memcpy(text, str + bodyStart, bodyLen);
+	text[bodyLen] = 0;
+	w.len = nameLen;
+	w.name = copy;
+
+	if (compileScript(bodyLen, text, dict, w.body))
+	{
+		freeCode(w.body);
+		return 0;
+	}
+	fuseCode(w.body);
+	if (!arenaCode(&dict->arena, w.body))
+	{
+		freeCode(w.body);
+		return 0;
+	}
+	wordEffects(&w, dict);
+
+	if (addWord(dict, &w) < 0)
+	{
+		return 0;
+	}
+	return i;
+}
+
+// Return the first instruction at or after the source position, or the
+// final OP_END.
+static struct Instr *instrAt(struct Code *code, int pos)
+{
+	int lo = 0;
+	int hi = code->len - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (code->instrs[mid].pos < pos)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return code->instrs + lo;
+}
+
+// Stack effect of each opcode (except OP_WORD, which uses its WordLookup),
+// and the number of instructions it executes.
+static const struct
+{
+	signed char in;
+	signed char out;
+	signed char size;
+} opEffects[OP_COUNT] =
+{
+	[OP_WORD]            = { 0, 0, 1 },
+	[OP_CALL]            = { 0, 0, 1 },
+	[OP_NUMBER]          = { 0, 1, 1 },
+	[OP_QUOTE]           = { 0, 1, 1 },
+	[OP_UNKNOWN]         = { 0, 0, 1 },
+	[OP_END]             = { 0, 0, 1 },
+	[OP_BRANCH]          = { 0, 0, 1 },
+	[OP_BRANCH_ZERO]     = { 1, 0, 1 },
+	[OP_FOR]             = { 1, 0, 1 },
+	[OP_NEXT]            = { 0, 0, 1 },
+	[OP_INDEX]           = { 0, 1, 1 },
+	[OP_ADD]             = { 2, 1, 1 },
+	[OP_SUBTRACT]        = { 2, 1, 1 },
+	[OP_MULTIPLY]        = { 2, 1, 1 },
+	[OP_DIVIDE]          = { 2, 1, 1 },
+	[OP_DROP]            = { 1, 0, 1 },
+	[OP_DUP]             = { 1, 2, 1 },
+	[OP_SWAP]            = { 2, 2, 1 },
+	[OP_OVER]            = { 2, 3, 1 },
+	[OP_NIP]             = { 2, 1, 1 },
+	[OP_OVER_OVER]       = { 2, 4, 2 },
+	[OP_DUP_MULTIPLY]    = { 1, 1, 2 },
+	[OP_SWAP_DROP]       = { 2, 1, 2 },
+	[OP_DROP_DROP]       = { 2, 0, 2 },
+	[OP_NUMBER_NUMBER]   = { 0, 2, 2 },
+	[OP_NUMBER_ADD]      = { 1, 1, 2 },
+	[OP_NUMBER_SUBTRACT] = { 1, 1, 2 },
+	[OP_NUMBER_MULTIPLY] = { 1, 1, 2 },
+};
+
+// Whether the instruction can jump by its arg
+static int isBranch(int op)
+{
+	return op == OP_BRANCH || op == OP_BRANCH_ZERO || op == OP_FOR || op == OP_NEXT;
+}
+
+// Work out the stack depth at every instruction from the declared stack
+// effects. Code that verifies only needs one stack check before it runs.
+int verifyCode(struct Code *code, struct WordDict *dict)
+{
+	int depth = 0; // relative to the depth at the start
+	int need = 0;
+	int grow = 0;
+	code->verified = 0;
+
+	// Depth at each instruction that has been reached, so that every
+	// branch to it can be checked to agree
+	int *depthAt = malloc(code->len * sizeof(*depthAt));
+	if (!depthAt)
+	{
+		return ERROR_UNVERIFIED;
+	}
+	for (int i = 0; i < code->len; i++)
+	{
+		depthAt[i] = INT_MIN;
+	}
+	int reachable = 1;
+	int err = 0;
+
+	for (int i = 0; i < code->len && !err; i += opEffects[code->instrs[i].op].size)
+	{
+		struct Instr *in = &code->instrs[i];
+		int numIn = opEffects[in->op].in;
+		int numOut = opEffects[in->op].out;
+		if (depthAt[i] != INT_MIN)
+		{
+			if (reachable && depthAt[i] != depth)
+			{
+				err = ERROR_UNVERIFIED;
+				break;
+			}
+			depth = depthAt[i];
+		}
+		else if (!reachable)
+		{
+			err = ERROR_UNVERIFIED;
+			break;
+		}
+		depthAt[i] = depth;
+		reachable = 1;
+
+		if (in->op == OP_UNKNOWN)
+		{
+			err = ERROR_WORD_NAME;
+			break;
+		}
+		if (in->op == OP_WORD || in->op == OP_CALL)
+		{
+			struct WordLookup *w = &dict->words[in->arg];
+			if (w->flags & (WORD_DYNAMIC | WORD_PARSING))
+			{
+				err = ERROR_UNVERIFIED;
+				break;
+			}
+			numIn = w->numInputs;
+			numOut = w->numOutputs;
+		}
+		if (in->op == OP_CALL && depth + dict->words[in->arg].body->grow > grow)
+		{
+			// The body can grow the stack more than its outputs
+			grow = depth + dict->words[in->arg].body->grow;
+		}
+		if (numIn - depth > need)
+		{
+			need = numIn - depth;
+		}
+		depth += numOut - numIn;
+		if (depth > grow)
+		{
+			grow = depth;
+		}
+
+		if (isBranch(in->op))
+		{
+			// Loops have to leave the stack as they found it
+			int target = i + in->arg;
+			if (depthAt[target] == INT_MIN)
+			{
+				depthAt[target] = depth;
+			}
+			else if (depthAt[target] != depth)
+			{
+				err = ERROR_UNVERIFIED;
+			}
+			reachable = (in->op != OP_BRANCH);
+		}
+	}
+	free(depthAt);
+	if (err)
+	{
+		return err;
+	}
+	if (grow > DATA_STACK_SZ)
+	{
+		return ERROR_STACK_OVERFLOW;
+	}
+	code->need = need;
+	code->grow = grow;
+	code->net = depth;
+	code->verified = 1;
+	return 0;
+}
+
+// Each instruction has two entry points: a checked one which checks the
+// stack first, and an unchecked one used for verified code.
+#if COMSCRIPT_THREADED
+#define ENTRY(op) C_##op:
+#define UNCHECKED(op) L_##op:
+#define NEXT() goto *labels[ip->op + mode]
+#define FALLTHROUGH()
+#else
+#define ENTRY(op) case op + OP_COUNT:
+#define UNCHECKED(op) case op:
+#define NEXT() continue
+// The checked case goes on into the unchecked one
+#if defined(__GNUC__)
+#define FALLTHROUGH() __attribute__((fallthrough))
+#else
+#define FALLTHROUGH()
+#endif
+#endif
+
+// Check that the stack has in items and room for the out items.
+#define CHECK(in, out) \
+	do \
+	{ \
+		if ((in) > sp) { err = ERROR_STACK_UNDERFLOW; goto error; } \
+		if ((out) - (in) > DATA_STACK_SZ - sp) { err = ERROR_STACK_OVERFLOW; goto error; } \
+	} while (0)
+
+// Stack access for the instruction bodies. TOP and SECOND are lvalues.
+#if COMSCRIPT_TOS_CACHE
+// The top item is in tos while sp > 0, and its slot in stack is out of date.
+#define TOP tos
+#define SPILL() do { if (sp) { stack[sp - 1] = tos; } } while (0)
+#define FILL() do { if (sp) { tos = stack[sp - 1]; } } while (0)
+#define PUSH(v) do { x = (v); SPILL(); tos = x; sp++; } while (0)
+#define POP() do { sp--; FILL(); } while (0)
+#else
+#define TOP stack[sp - 1]
+#define SPILL() do { } while (0)
+#define FILL() do { } while (0)
+#define PUSH(v) do { x = (v); stack[sp++] = x; } while (0)
+#define POP() do { sp--; } while (0)
+#endif
+#define SECOND stack[sp - 2]
+// Replace the top two items with the result of an expression of them
+#define BINARY(expr) do { x = (expr); sp--; TOP = x; } while (0)
+
+// Start of an instruction, checking the stack with its opEffects
+#define OPCASE(op) ENTRY(op) CHECK(opEffects[op].in, opEffects[op].out); FALLTHROUGH(); UNCHECKED(op)
+
+#if COMSCRIPT_THREADED
+// Labels for the unchecked instructions, followed by the checked ones
+#define LABELS(op) [op] = &&L_##op, [OP_COUNT + op] = &&C_##op
+#endif
+
+static int execCode(struct ComInterp *ci, struct Code *code)
+{
+	struct WordDict *dict = ci->dict;
+	struct Instr *ip = code->instrs;
+	// The stack index is kept in a local and stored back whenever a word
+	// written in C may use it.
+	int *stack = ci->stack;
+	int sp = ci->sp;
+	int err;
+	int x;
+	// Index and count of each open for loop
+	int loops[2 * CONTROL_DEPTH];
+	int lp = 0;
+#if COMSCRIPT_TOS_CACHE
+	int tos = 0;
+	FILL();
+#endif
+
+	// Verified code is checked once here, and then runs unchecked.
+	int mode = OP_COUNT;
+	if (code->verified)
+	{
+		if (sp < code->need)
+		{
+			err = ERROR_STACK_UNDERFLOW;
+			goto error;
+		}
+		if (sp + code->grow > DATA_STACK_SZ)
+		{
+			err = ERROR_STACK_OVERFLOW;
+			goto error;
+		}
+		mode = 0;
+	}
+
+#if COMSCRIPT_THREADED
+	static void *labels[2 * OP_COUNT] =
+	{
+		LABELS(OP_WORD),
+		LABELS(OP_CALL),
+		LABELS(OP_NUMBER),
+		LABELS(OP_QUOTE),
+		LABELS(OP_UNKNOWN),
+		LABELS(OP_END),
+		LABELS(OP_BRANCH),
+		LABELS(OP_BRANCH_ZERO),
+		LABELS(OP_FOR),
+		LABELS(OP_NEXT),
+		LABELS(OP_INDEX),
+		LABELS(OP_ADD),
+		LABELS(OP_SUBTRACT),
+		LABELS(OP_MULTIPLY),
+		LABELS(OP_DIVIDE),
+		LABELS(OP_DROP),
+		LABELS(OP_DUP),
+		LABELS(OP_SWAP),
+		LABELS(OP_OVER),
+		LABELS(OP_NIP),
+		LABELS(OP_OVER_OVER),
+		LABELS(OP_DUP_MULTIPLY),
+		LABELS(OP_SWAP_DROP),
+		LABELS(OP_DROP_DROP),
+		LABELS(OP_NUMBER_NUMBER),
+		LABELS(OP_NUMBER_ADD),
+		LABELS(OP_NUMBER_SUBTRACT),
+		LABELS(OP_NUMBER_MULTIPLY),
+	};
+	NEXT();
+#else
+	while (1)
+	{
+		switch (ip->op + mode)
+		{
+#endif
+	ENTRY(OP_WORD)
+		CHECK(dict->words[ip->arg].numInputs, dict->words[ip->arg].numOutputs);
+		FALLTHROUGH();
+	UNCHECKED(OP_WORD)
+	{
+		// Call-threaded: words defined in C are called through the dictionary
+		struct WordLookup *w = &dict->words[ip->arg];
+		ci->cursor = code->src + ip->pos;
+		const char *save_prog = ci->cursor;
+		SPILL();
+		ci->sp = sp;
+		WORD_ENTER(ci);
+		w->func();
+		WORD_EXIT(ci, ip->arg);
+		sp = ci->sp;
+		FILL();
+		// If the function modified the prog pointer (such as to skip
+		// over a quote), then continue at the word it points to.
+		if (ci->cursor != save_prog)
+		{
+			ip = instrAt(code, ci->cursor - code->src);
+			NEXT();
+		}
+		ip++;
+		NEXT();
+	}
+	ENTRY(OP_CALL)
+		CHECK(dict->words[ip->arg].numInputs, dict->words[ip->arg].numOutputs);
+		FALLTHROUGH();
+	UNCHECKED(OP_CALL)
+	{
+		// The body checks the stack itself if it isn't verified
+		SPILL();
+		ci->sp = sp;
+		WORD_ENTER(ci);
+		err = execCode(ci, dict->words[ip->arg].body);
+		WORD_EXIT(ci, ip->arg);
+		if (err)
+		{
+			return err;
+		}
+		sp = ci->sp;
+		FILL();
+		ip++;
+		NEXT();
+	}
+	OPCASE(OP_NUMBER)
+		PUSH(ip->arg);
+		ip++;
+		NEXT();
+	OPCASE(OP_QUOTE)
+		PUSH(ip->arg);
+		ip++;
+		NEXT();
+	ENTRY(OP_UNKNOWN)
+	UNCHECKED(OP_UNKNOWN)
+		err = ERROR_WORD_NAME;
+		goto error;
+	ENTRY(OP_END)
+	UNCHECKED(OP_END)
+		SPILL();
+		ci->sp = sp;
+		return 0;
+	OPCASE(OP_BRANCH)
+		ip += ip->arg;
+		NEXT();
+	OPCASE(OP_BRANCH_ZERO)
+		x = TOP;
+		POP();
+		ip += x? 1 : ip->arg;
+		NEXT();
+	OPCASE(OP_FOR)
+		x = TOP;
+		POP();
+		if (x > 0)
+		{
+			loops[lp++] = 0;
+			loops[lp++] = x;
+			ip++;
+		}
+		else
+		{
+			ip += ip->arg;
+		}
+		NEXT();
+	OPCASE(OP_NEXT)
+		if (++loops[lp - 2] < loops[lp - 1])
+		{
+			ip += ip->arg;
+		}
+		else
+		{
+			lp -= 2;
+			ip++;
+		}
+		NEXT();
+	OPCASE(OP_INDEX)
+		PUSH(loops[lp - 2 - 2 * ip->arg]);
+		ip++;
+		NEXT();
+	OPCASE(OP_ADD)
+		BINARY(SECOND + TOP);
+		ip++;
+		NEXT();
+	OPCASE(OP_SUBTRACT)
+		BINARY(SECOND - TOP);
+		ip++;
+		NEXT();
+	OPCASE(OP_MULTIPLY)
+		BINARY(SECOND * TOP);
+		ip++;
+		NEXT();
+	OPCASE(OP_DIVIDE)
+		BINARY(SECOND / TOP);
+		ip++;
+		NEXT();
+	OPCASE(OP_DROP)
+		POP();
+		ip++;
+		NEXT();
+	OPCASE(OP_DUP)
+		PUSH(TOP);
+		ip++;
+		NEXT();
+	OPCASE(OP_SWAP)
+		x = TOP;
+		TOP = SECOND;
+		SECOND = x;
+		ip++;
+		NEXT();
+	OPCASE(OP_OVER)
+		PUSH(SECOND);
+		ip++;
+		NEXT();
+	OPCASE(OP_NIP)
+		BINARY(TOP);
+		ip++;
+		NEXT();
+	OPCASE(OP_OVER_OVER)
+		PUSH(SECOND);
+		PUSH(SECOND);
+		ip += 2;
+		NEXT();
+	OPCASE(OP_DUP_MULTIPLY)
+		TOP *= TOP;
+		ip += 2;
+		NEXT();
+	OPCASE(OP_SWAP_DROP)
+		BINARY(TOP);
+		ip += 2;
+		NEXT();
+	OPCASE(OP_DROP_DROP)
+		sp--;
+		POP();
+		ip += 2;
+		NEXT();
+	OPCASE(OP_NUMBER_NUMBER)
+		PUSH(ip[0].arg);
+		PUSH(ip[1].arg);
+		ip += 2;
+		NEXT();
+	OPCASE(OP_NUMBER_ADD)
+		TOP += ip->arg;
+		ip += 2;
+		NEXT();
+	OPCASE(OP_NUMBER_SUBTRACT)
+		TOP -= ip->arg;
+		ip += 2;
+		NEXT();
+	OPCASE(OP_NUMBER_MULTIPLY)
+		TOP *= ip->arg;
+		ip += 2;
+		NEXT();
+#if !COMSCRIPT_THREADED
+		}
+	}
+#endif
+error:
+	SPILL();
+	ci->sp = sp;
+	ci->cursor = code->src + ip->pos;
+	return err;
+}
+
+static int runJit(struct ComInterp *ci, struct Code *code);
+
+int comRunCode(struct ComInterp *ci, struct Code *code)
+{
+	struct ComInterp *save = comCurrent;
+	comCurrent = ci;
+	int err = code->jit? runJit(ci, code) : execCode(ci, code);
+	comCurrent = save;
+	return err;
+}
+
+int runCode(struct Code *code, struct WordDict *dict)
+{
+	comCurrent->dict = dict;
+	return comRunCode(comCurrent, code);
+}
+
+#undef ENTRY
+#undef UNCHECKED
+#undef NEXT
+#undef FALLTHROUGH
+#undef CHECK
+#undef OPCASE
+#undef LABELS
+#undef TOP
+#undef SECOND
+#undef SPILL
+#undef FILL
+#undef PUSH
+#undef POP
+#undef BINARY
+
+// Pairs of instructions that fuseCode replaces. The table is based on the
+// sequences that are most common in the example scripts.
+static const struct
+{
+	int first;
+	int second;
+	int fused;
+	const char *name;
+} fusions[] =
+{
+	{ OP_NUMBER, OP_NUMBER,   OP_NUMBER_NUMBER,   "n n" },
+	{ OP_NUMBER, OP_MULTIPLY, OP_NUMBER_MULTIPLY, "n *" },
+	{ OP_NUMBER, OP_ADD,      OP_NUMBER_ADD,      "n +" },
+	{ OP_NUMBER, OP_SUBTRACT, OP_NUMBER_SUBTRACT, "n -" },
+	{ OP_OVER,   OP_OVER,     OP_OVER_OVER,       "over over" },
+	{ OP_DUP,    OP_MULTIPLY, OP_DUP_MULTIPLY,    "dup *" },
+	{ OP_SWAP,   OP_DROP,     OP_SWAP_DROP,       "swap drop" },
+	{ OP_DROP,   OP_DROP,     OP_DROP_DROP,       "drop drop" },
+};
+
+#define NUM_FUSIONS ((int)(sizeof(fusions)/sizeof(fusions[0])))
+
+// Return the index of the fusion for the instruction pair at in, or -1.
+static int matchFusion(struct Instr *in)
+{
+	for (int f = 0; f < NUM_FUSIONS; f++)
+	{
+		if (in[0].op == fusions[f].first && in[1].op == fusions[f].second)
+		{
+			return f;
+		}
+	}
+	return -1;
+}
+
+int fuseCode(struct Code *code)
+{
+	// Branches have to land on whole instructions, so their targets can't be
+	// the second of a pair
+	char *target = calloc(code->len + 1, 1);
+	if (!target)
+	{
+		return 0;
+	}
+	for (int i = 0; i < code->len; i++)
+	{
+		if (isBranch(code->instrs[i].op))
+		{
+			target[i + code->instrs[i].arg] = 1;
+		}
+	}
+
+	int count = 0;
+	for (int i = 0; i + 1 < code->len; i++)
+	{
+		struct Instr *in = &code->instrs[i];
+		int f = matchFusion(in);
+		if (f < 0 || target[i + 1])
+		{
+			continue;
+		}
+		// Prefer "n +" over "n n" for code like "1 2 +"
+		if (fusions[f].fused == OP_NUMBER_NUMBER && i + 2 < code->len && !target[i + 2])
+		{
+			int next = matchFusion(in + 1);
+			if (next >= 0 && fusions[next].fused != OP_NUMBER_NUMBER)
+			{
+				continue;
+			}
+		}
+		in->op = fusions[f].fused;
+		count++;
+		// Don't fuse the second instruction again
+		i++;
+	}
+	free(target);
+	return count;
+}
+
+// Print the superinstructions in one body, after the where prefix, and add
+// them to counts
+static void listFusions(FILE *fp, const char *where, int whereLen, struct Code *code, int *counts)
+{
+	for (int i = 0; i < code->len; i++)
+	{
+		for (int f = 0; f < NUM_FUSIONS; f++)
+		{
+			if (code->instrs[i].op == fusions[f].fused)
+			{
+				fprintf(fp, "fusion: %.*s%d: %s\n", whereLen, where, code->instrs[i].pos, fusions[f].name);
+				counts[f]++;
+			}
+		}
+	}
+}
+
+// Positions are in the text of each body, which is named for defined words
+// and numbered for quotes.
+void printFusions(FILE *fp, struct Code *code, struct WordDict *dict)
+{
+	int counts[NUM_FUSIONS] = {0};
+	listFusions(fp, "", 0, code, counts);
+	for (int i = 0; i < dict->len; i++)
+	{
+		struct WordLookup *w = &dict->words[i];
+		if (w->body)
+		{
+			char where[64];
+			int n = snprintf(where, sizeof(where), "%.*s: ", w->len < 48? w->len : 48, w->name);
+			listFusions(fp, where, n, w->body, counts);
+		}
+	}
+	for (int q = 0; q < dict->numQuotes; q++)
+	{
+		char where[32];
+		int n = snprintf(where, sizeof(where), "quote %d: ", q);
+		listFusions(fp, where, n, dict->quotes[q].code, counts);
+	}
+	for (int f = 0; f < NUM_FUSIONS; f++)
+	{
+		fprintf(fp, "fusions: %-10s %d\n", fusions[f].name, counts[f]);
+	}
+}
+
+// State of the stack while transpiling: slot k is the C local sk, which
+// mirrors st[k] in the interpreter's stack, where st is the stack at the
+// start of the function minus the items it needs.
+struct Transpiler
+{
+	FILE *fp;
+	int depth; // number of slots in use
+	char *dirty; // whether sk has changed since it was stored to st[k]
+};
+
+static void transpileSet(struct Transpiler *t, int k, const char *fmt, int a, int b)
+{
+	fprintf(t->fp, "\ts%d = ", k);
+	fprintf(t->fp, fmt, a, b);
+	fprintf(t->fp, ";\n");
+	t->dirty[k] = 1;
+}
+
+// Store the changed slots to the interpreter's stack
+static void transpileSpill(struct Transpiler *t)
+{
+	for (int k = 0; k < t->depth; k++)
+	{
+		if (t->dirty[k])
+		{
+			fprintf(t->fp, "\tst[%d] = s%d;\n", k, k);
+			t->dirty[k] = 0;
+		}
+	}
+}
+
+// Write C for one instruction (not a superinstruction)
+static int transpileOp(struct Transpiler *t, int op, int arg, struct WordDict *dict)
+{
+	int d = t->depth;
+	switch (op)
+	{
+		case OP_WORD:
+		{
+			struct WordLookup *w = &dict->words[arg];
+			if (!w->cname)
+			{
+				return ERROR_COMPILE;
+			}
+			// Words written in C use the interpreter's stack
+			transpileSpill(t);
+			fprintf(t->fp, "\tci->sp = base + %d;\n", d);
+			fprintf(t->fp, "\t%s();\n", w->cname);
+			t->depth = d - w->numInputs + w->numOutputs;
+			for (int k = d - w->numInputs; k < t->depth; k++)
+			{
+				fprintf(t->fp, "\ts%d = st[%d];\n", k, k);
+				t->dirty[k] = 0;
+			}
+			return 0;
+		}
+		case OP_NUMBER:
+			transpileSet(t, d, "%d", arg, 0);
+			t->depth++;
+			return 0;
+		case OP_ADD:      transpileSet(t, d - 2, "s%d + s%d", d - 2, d - 1); t->depth--; return 0;
+		case OP_SUBTRACT: transpileSet(t, d - 2, "s%d - s%d", d - 2, d - 1); t->depth--; return 0;
+		case OP_MULTIPLY: transpileSet(t, d - 2, "s%d * s%d", d - 2, d - 1); t->depth--; return 0;
+		case OP_DIVIDE:   transpileSet(t, d - 2, "s%d / s%d", d - 2, d - 1); t->depth--; return 0;
+		case OP_DROP:     t->depth--; return 0;
+		case OP_DUP:      transpileSet(t, d, "s%d", d - 1, 0); t->depth++; return 0;
+		case OP_OVER:     transpileSet(t, d, "s%d", d - 2, 0); t->depth++; return 0;
+		case OP_NIP:      transpileSet(t, d - 2, "s%d", d - 1, 0); t->depth--; return 0;
+		case OP_SWAP:
+			fprintf(t->fp, "\tx = s%d;\n", d - 1);
+			transpileSet(t, d - 1, "s%d", d - 2, 0);
+			transpileSet(t, d - 2, "x", 0, 0);
+			return 0;
+		case OP_END:
+			return 0;
+		default:
+			return ERROR_COMPILE;
+	}
+}
+
+// Write code as a C function `int name(void)` that calls the words directly
+// and keeps the stack in locals between calls to words written in C. Returns
+// an error code like runCode, and the code must pass verifyCode.
+int transpileCode(FILE *fp, const char *name, struct Code *code, struct WordDict *dict)
+{
+	int err = verifyCode(code, dict);
+	if (err)
+	{
+		return err;
+	}
+
+	struct Transpiler t;
+	t.fp = fp;
+	t.depth = code->need;
+	t.dirty = calloc(code->need + code->grow + 1, 1);
+	if (!t.dirty)
+	{
+		return ERROR_COMPILE;
+	}
+
+	// Declare the words used
+	char *declared = calloc(dict->len, 1);
+	if (!declared)
+	{
+		free(t.dirty);
+		return ERROR_COMPILE;
+	}
+	for (int i = 0; i < code->len; i++)
+	{
+		struct Instr *in = &code->instrs[i];
+		if (in->op == OP_CALL)
+		{
+			// Words defined by the script have no C function to call
+			free(declared);
+			free(t.dirty);
+			return ERROR_COMPILE;
+		}
+		if (in->op == OP_WORD && dict->words[in->arg].cname && !declared[in->arg])
+		{
+			fprintf(fp, "void %s(void);\n", dict->words[in->arg].cname);
+			declared[in->arg] = 1;
+		}
+	}
+	free(declared);
+
+	fprintf(fp, "\nint %s(void)\n{\n", name);
+	fprintf(fp, "\tstruct ComInterp *ci = comCurrent;\n");
+	fprintf(fp, "\tif (ci->sp < %d) { return ERROR_STACK_UNDERFLOW; }\n", code->need);
+	fprintf(fp, "\tif (ci->sp + %d > DATA_STACK_SZ) { return ERROR_STACK_OVERFLOW; }\n", code->grow);
+	fprintf(fp, "\tint base = ci->sp - %d;\n", code->need);
+	fprintf(fp, "\tint *st = ci->stack + base;\n");
+	fprintf(fp, "\tint x;\n");
+	for (int k = 0; k < code->need + code->grow; k++)
+	{
+		if (k < code->need)
+		{
+			fprintf(fp, "\tint s%d = st[%d];\n", k, k);
+		}
+		else
+		{
+			fprintf(fp, "\tint s%d = 0;\n", k);
+		}
+	}
+	fprintf(fp, "\t(void)x;\n");
+
+	for (int i = 0; i < code->len && !err; i += opEffects[code->instrs[i].op].size)
+	{
+		struct Instr *in = &code->instrs[i];
+		int f;
+		for (f = 0; f < NUM_FUSIONS; f++)
+		{
+			if (in->op == fusions[f].fused)
+			{
+				break;
+			}
+		}
+		if (f < NUM_FUSIONS)
+		{
+			// Superinstructions are written as the two words they replaced
+			err = transpileOp(&t, fusions[f].first, in[0].arg, dict);
+			if (!err)
+			{
+				err = transpileOp(&t, in[1].op, in[1].arg, dict);
+			}
+		}
+		else
+		{
+			err = transpileOp(&t, in->op, in->arg, dict);
+		}
+	}
+
+	transpileSpill(&t);
+	fprintf(fp, "\tci->sp = base + %d;\n", t.depth);
+	fprintf(fp, "\treturn 0;\n}\n");
+	free(t.dirty);
+	return err;
+}
+
+#if COMSCRIPT_JIT
+
+#include <stddef.h>
+
+// x86-64 registers
+enum
+{
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R12 = 12, R13 = 13, R14 = 14,
+};
+
+// Machine code buffer. The stack is addressed with static offsets from rbx,
+// which points at the first item the code needs, so the JIT keeps no stack
+// index. The top of the stack is kept in r14d when tos is set.
+struct Jit
+{
+	unsigned char *buf;
+	int len;
+	int depth; // number of stack slots from rbx
+	int tos; // whether r14d holds slot depth - 1
+	int tosDirty; // whether r14d has changed since it was loaded
+};
+
+static void jitByte(struct Jit *j, int b)
+{
+	j->buf[j->len++] = b;
+}
+
+static void jitInt(struct Jit *j, int n)
+{
+	memcpy(j->buf + j->len, &n, 4);
+	j->len += 4;
+}
+
+static void jitRex(struct Jit *j, int w, int reg, int base)
+{
+	int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+	if (rex != 0x40)
+	{
+		jitByte(j, rex);
+	}
+}
+
+// op reg, [base + disp] (or the reverse for stores), 32-bit operands
+static void jitMem(struct Jit *j, int opcode, int reg, int base, int disp)
+{
+	jitRex(j, 0, reg, base);
+	if (opcode > 0xff)
+	{
+		jitByte(j, opcode >> 8);
+	}
+	jitByte(j, opcode & 0xff);
+	jitByte(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+	{
+		jitByte(j, 0x24); // SIB for rsp/r12 base
+	}
+	jitInt(j, disp);
+}
+
+// op rm, reg with register operands
+static void jitReg(struct Jit *j, int opcode, int reg, int rm)
+{
+	jitRex(j, 0, reg, rm);
+	if (opcode > 0xff)
+	{
+		jitByte(j, opcode >> 8);
+	}
+	jitByte(j, opcode & 0xff);
+	jitByte(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+#define JIT_LOAD  0x8b   // mov r32, r/m32
+#define JIT_STORE 0x89   // mov r/m32, r32
+#define JIT_ADD   0x03   // add r32, r/m32
+#define JIT_SUB   0x2b   // sub r32, r/m32
+#define JIT_IMUL  0x0faf // imul r32, r/m32
+
+// Address of stack slot k
+#define SLOT(k) (4 * (k))
+
+// Make sure r14d holds the top of the stack
+static void jitLoadTos(struct Jit *j)
+{
+	if (!j->tos)
+	{
+		jitMem(j, JIT_LOAD, R14, RBX, SLOT(j->depth - 1));
+		j->tos = 1;
+		j->tosDirty = 0;
+	}
+}
+
+// Store r14d to the stack if it has changed
+static void jitStoreTos(struct Jit *j)
+{
+	if (j->tos && j->tosDirty)
+	{
+		jitMem(j, JIT_STORE, R14, RBX, SLOT(j->depth - 1));
+	}
+	j->tosDirty = 0;
+}
+
+// Run the body of a word defined by the script. Verified code has already
+// made sure that it has the items it needs and room to grow.
+static void jitCall(struct Code *body)
+{
+	comRunCode(comCurrent, body);
+}
+
+// Write machine code for one instruction (not a superinstruction)
+static int jitOp(struct Jit *j, int op, int arg, struct WordDict *dict)
+{
+	int d = j->depth;
+	switch (op)
+	{
+		case OP_WORD:
+		{
+			struct WordLookup *w = &dict->words[arg];
+			jitStoreTos(j);
+			j->tos = 0;
+			// ci->sp = base + d
+			jitMem(j, 0x8d, RAX, R13, d); // lea eax, [r13 + d]
+			jitMem(j, JIT_STORE, RAX, R12, offsetof(struct ComInterp, sp));
+			// mov rax, func; call rax
+			jitByte(j, 0x48);
+			jitByte(j, 0xb8);
+			void (*func)(void) = w->func;
+			memcpy(j->buf + j->len, &func, 8);
+			j->len += 8;
+			jitByte(j, 0xff);
+			jitByte(j, 0xd0);
+			j->depth = d - w->numInputs + w->numOutputs;
+			return 0;
+		}
+		case OP_CALL:
+		{
+			struct WordLookup *w = &dict->words[arg];
+			if (!w->body->jit)
+			{
+				jitCode(w->body, dict);
+			}
+			jitStoreTos(j);
+			j->tos = 0;
+			// ci->sp = base + d
+			jitMem(j, 0x8d, RAX, R13, d); // lea eax, [r13 + d]
+			jitMem(j, JIT_STORE, RAX, R12, offsetof(struct ComInterp, sp));
+			// mov rdi, body; mov rax, jitCall; call rax
+			jitByte(j, 0x48);
+			jitByte(j, 0xbf);
+			memcpy(j->buf + j->len, &w->body, 8);
+			j->len += 8;
+			jitByte(j, 0x48);
+			jitByte(j, 0xb8);
+			void (*func)(struct Code *) = jitCall;
+			memcpy(j->buf + j->len, &func, 8);
+			j->len += 8;
+			jitByte(j, 0xff);
+			jitByte(j, 0xd0);
+			j->depth = d - w->numInputs + w->numOutputs;
+			return 0;
+		}
+		case OP_NUMBER:
+		case OP_QUOTE:
+			jitStoreTos(j);
+			jitRex(j, 0, 0, R14);
+			jitByte(j, 0xb8 + (R14 & 7)); // mov r14d, imm32
+			jitInt(j, arg);
+			j->depth++;
+			j->tos = 1;
+			j->tosDirty = 1;
+			return 0;
+		case OP_ADD:
+		case OP_MULTIPLY:
+			jitLoadTos(j);
+			jitMem(j, (op == OP_ADD)? JIT_ADD : JIT_IMUL, R14, RBX, SLOT(d - 2));
+			j->depth--;
+			j->tosDirty = 1;
+			return 0;
+		case OP_SUBTRACT:
+			jitLoadTos(j);
+			jitMem(j, JIT_LOAD, RAX, RBX, SLOT(d - 2));
+			jitReg(j, 0x29, R14, RAX); // sub eax, r14d
+			jitReg(j, 0x89, RAX, R14); // mov r14d, eax
+			j->depth--;
+			j->tosDirty = 1;
+			return 0;
+		case OP_DIVIDE:
+			jitLoadTos(j);
+			jitMem(j, JIT_LOAD, RAX, RBX, SLOT(d - 2));
+			jitByte(j, 0x99); // cdq
+			jitReg(j, 0xf7, 7, R14); // idiv r14d
+			jitReg(j, 0x89, RAX, R14); // mov r14d, eax
+			j->depth--;
+			j->tosDirty = 1;
+			return 0;
+		case OP_DROP:
+			j->tos = 0;
+			j->tosDirty = 0;
+			j->depth--;
+			return 0;
+		case OP_DUP:
+			jitLoadTos(j);
+			jitMem(j, JIT_STORE, R14, RBX, SLOT(d - 1));
+			j->depth++;
+			j->tosDirty = 1;
+			return 0;
+		case OP_SWAP:
+			jitLoadTos(j);
+			jitMem(j, JIT_LOAD, RAX, RBX, SLOT(d - 2));
+			jitMem(j, JIT_STORE, R14, RBX, SLOT(d - 2));
+			jitReg(j, 0x89, RAX, R14); // mov r14d, eax
+			j->tosDirty = 1;
+			return 0;
+		case OP_OVER:
+			jitStoreTos(j);
+			jitMem(j, JIT_LOAD, R14, RBX, SLOT(d - 2));
+			j->depth++;
+			j->tos = 1;
+			j->tosDirty = 1;
+			return 0;
+		case OP_NIP:
+			jitLoadTos(j);
+			j->depth--;
+			j->tosDirty = 1;
+			return 0;
+		case OP_END:
+			return 0;
+		default:
+			return ERROR_JIT;
+	}
+}
+
+int jitCode(struct Code *code, struct WordDict *dict)
+{
+	if (verifyCode(code, dict))
+	{
+		return ERROR_JIT;
+	}
+
+	// Every instruction takes at most 48 bytes
+	int size = code->len * 2 * 48 + 128;
+	size = (size + 4095) & ~4095;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		return ERROR_JIT;
+	}
+
+	struct Jit j = { mem, 0, code->need, 0, 0 };
+
+	// int jit(struct ComInterp *ci)
+	jitByte(&j, 0x55); // push rbp
+	jitByte(&j, 0x53); // push rbx
+	jitByte(&j, 0x41); jitByte(&j, 0x54); // push r12
+	jitByte(&j, 0x41); jitByte(&j, 0x55); // push r13
+	jitByte(&j, 0x41); jitByte(&j, 0x56); // push r14
+	jitByte(&j, 0x49); jitByte(&j, 0x89); jitByte(&j, 0xfc); // mov r12, rdi
+	// r13d = ci->sp - need
+	jitMem(&j, JIT_LOAD, R13, R12, offsetof(struct ComInterp, sp));
+	jitByte(&j, 0x41); jitByte(&j, 0x81); jitByte(&j, 0xed); jitInt(&j, code->need); // sub r13d, need
+	// rbx = &ci->stack[r13d]
+	jitByte(&j, 0x4b); jitByte(&j, 0x8d); jitByte(&j, 0x9c); jitByte(&j, 0xac);
+	jitInt(&j, offsetof(struct ComInterp, stack)); // lea rbx, [r12 + r13 * 4 + stack]
+
+	int err = 0;
+	for (int i = 0; i < code->len && !err; i += opEffects[code->instrs[i].op].size)
+	{
+		struct Instr *in = &code->instrs[i];
+		int f;
+		for (f = 0; f < NUM_FUSIONS; f++)
+		{
+			if (in->op == fusions[f].fused)
+			{
+				break;
+			}
+		}
+		if (f < NUM_FUSIONS)
+		{
+			err = jitOp(&j, fusions[f].first, in[0].arg, dict);
+			if (!err)
+			{
+				err = jitOp(&j, in[1].op, in[1].arg, dict);
+			}
+		}
+		else
+		{
+			err = jitOp(&j, in->op, in->arg, dict);
+		}
+	}
+	if (err)
+	{
+		munmap(mem, size);
+		return err;
+	}
+
+	// ci->sp = base + depth
+	jitStoreTos(&j);
+	jitMem(&j, 0x8d, RAX, R13, j.depth); // lea eax, [r13 + depth]
+	jitMem(&j, JIT_STORE, RAX, R12, offsetof(struct ComInterp, sp));
+	jitByte(&j, 0x31); jitByte(&j, 0xc0); // xor eax, eax
+	jitByte(&j, 0x41); jitByte(&j, 0x5e); // pop r14
+	jitByte(&j, 0x41); jitByte(&j, 0x5d); // pop r13
+	jitByte(&j, 0x41); jitByte(&j, 0x5c); // pop r12
+	jitByte(&j, 0x5b); // pop rbx
+	jitByte(&j, 0x5d); // pop rbp
+	jitByte(&j, 0xc3); // ret
+
+	// Never writable and executable at the same time
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC))
+	{
+		munmap(mem, size);
+		return ERROR_JIT;
+	}
+	code->jit = mem;
+	code->jitSize = size;
+	return 0;
+}
+
+static int runJit(struct ComInterp *ci, struct Code *code)
+{
+	if (ci->sp < code->need)
+	{
+		ci->cursor = code->src;
+		return ERROR_STACK_UNDERFLOW;
+	}
+	if (ci->sp + code->grow > DATA_STACK_SZ)
+	{
+		ci->cursor = code->src;
+		return ERROR_STACK_OVERFLOW;
+	}
+	int (*func)(struct ComInterp *) = (int (*)(struct ComInterp *))code->jit;
+	return func(ci);
+}
+
+static void freeJit(struct Code *code)
+{
+	if (code->jit)
+	{
+		munmap(code->jit, code->jitSize);
+		code->jit = NULL;
+	}
+}
+
+#undef SLOT
+
+#else
+
+int jitCode(struct Code *code, struct WordDict *dict)
+{
+	(void)code;
+	(void)dict;
+	return ERROR_JIT;
+}
+
+static int runJit(struct ComInterp *ci, struct Code *code)
+{
+	return execCode(ci, code);
+}
+
+static void freeJit(struct Code *code)
+{
+	(void)code;
+}
+
+#endif /* COMSCRIPT_JIT */
+
+// Header of a file written by saveCode, followed by the instructions, then
+// a CodeFileEntry for each word the script defined and each of its quotes
+struct CodeFile
+{
+	char magic[4]; // "CSC3"
+	int format; // CODE_FILE_FORMAT
+	unsigned long long textHash; // hashText of the source text
+	unsigned long long dictHash; // hashDict of the built-in words
+	unsigned long long codeHash; // hash of everything after the header
+	int srcLen;
+	int len;
+	int numWords; // words defined by the script
+	int numQuotes; // length of the quote table
+};
+
+// A defined word or a quote in a CodeFile, followed by its name, its text
+// and its instructions
+struct CodeFileEntry
+{
+	int nameLen; // 0 for a quote
+	int textLen;
+	int dictLen; // dictionary length when a quote was compiled
+	int len; // number of instructions
+};
+
+// Changes whenever the meaning of the saved instructions would
+#define CODE_FILE_FORMAT (OP_COUNT * 1000 + (int)sizeof(struct Instr))
+
+// 64-bit FNV-1a
+static unsigned long long hashBytes(unsigned long long h, const void *p, long len)
+{
+	const unsigned char *bytes = p;
+	for (long i = 0; i < len; i++)
+	{
+		h = (h ^ bytes[i]) * 1099511628211ull;
+	}
+	return h;
+}
+
+unsigned long long hashText(int len, const char *str)
+{
+	return hashBytes(14695981039346656037ull, str, len);
+}
+
+// Hash everything about the built-in words that compiled code depends on.
+// Words defined by the script are skipped, because they are only added while
+// the script compiles, after loadCode has already checked the hash.
+static unsigned long long hashDict(struct WordDict *dict)
+{
+	unsigned long long h = 14695981039346656037ull;
+	int stackSize = DATA_STACK_SZ;
+	h = hashBytes(h, &stackSize, sizeof(stackSize));
+	for (int i = 0; i < dict->len; i++)
+	{
+		struct WordLookup *w = &dict->words[i];
+		if (w->body)
+		{
+			continue;
+		}
+		int layout[5] = { w->len, w->numInputs, w->numOutputs, w->flags, coreOp(w->func) };
+		h = hashBytes(h, layout, sizeof(layout));
+		h = hashBytes(h, w->name, w->len);
+	}
+	return h;
+}
+
+// Write bytes to fp and add them to the hash
+static int writeHashed(FILE *fp, const void *p, long len, unsigned long long *h)
+{
+	*h = hashBytes(*h, p, len);
+	return fwrite(p, 1, len, fp) == (size_t)len;
+}
+
+// Write an entry for a defined word or a quote
+static int writeEntry(FILE *fp, int nameLen, const char *name, int dictLen, struct Code *code, unsigned long long *h)
+{
+	struct CodeFileEntry e = { nameLen, code->srcLen, dictLen, code->len };
+	return writeHashed(fp, &e, sizeof(e), h)
+		&& writeHashed(fp, name, nameLen, h)
+		&& writeHashed(fp, code->src, code->srcLen, h)
+		&& writeHashed(fp, code->instrs, code->len * sizeof(*code->instrs), h);
+}
+
+// The words and quotes that the script defined are saved with it, and the
+// hash in the header is filled in after everything else is written.
+int saveCode(const char *path, struct Code *code, struct WordDict *dict)
+{
+	// Defined words have to come after all the others, so that they get the
+	// same indexes when loadCode adds them back
+	int base = dict->len;
+	for (int i = 0; i < dict->len; i++)
+	{
+		if (dict->words[i].body && base == dict->len)
+		{
+			base = i;
+		}
+		else if (!dict->words[i].body && base < dict->len)
+		{
+			return ERROR_COMPILE;
+		}
+	}
+
+	struct CodeFile header = {0};
+	memcpy(header.magic, "CSC3", 4);
+	header.format = CODE_FILE_FORMAT;
+	header.textHash = hashText(code->srcLen, code->src);
+	header.dictHash = hashDict(dict);
+	header.srcLen = code->srcLen;
+	header.len = code->len;
+	header.numWords = dict->len - base;
+	header.numQuotes = dict->numQuotes;
+
+	// Other processes may have the file mapped, or be reading it, so it is
+	// written under a temporary name and renamed over the old one at the end
+	size_t pathLen = strlen(path);
+	char *tmp = malloc(pathLen + sizeof(".XXXXXX"));
+	if (!tmp)
+	{
+		return ERROR_COMPILE;
+	}
+	memcpy(tmp, path, pathLen);
+	memcpy(tmp + pathLen, ".XXXXXX", sizeof(".XXXXXX"));
+	int fd = mkstemp(tmp);
+	FILE *fp = (fd < 0)? NULL : fdopen(fd, "wb");
+	if (!fp)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+			remove(tmp);
+		}
+		free(tmp);
+		return ERROR_COMPILE;
+	}
+	// mkstemp makes the file private to the owner
+	fchmod(fd, 0644);
+	unsigned long long h = 14695981039346656037ull;
+	int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& writeHashed(fp, code->instrs, code->len * sizeof(*code->instrs), &h);
+	for (int i = base; ok && i < dict->len; i++)
+	{
+		struct WordLookup *w = &dict->words[i];
+		ok = writeEntry(fp, w->len, w->name, 0, w->body, &h);
+	}
+	for (int q = 0; ok && q < dict->numQuotes; q++)
+	{
+		struct Quote *p = &dict->quotes[q];
+		ok = writeEntry(fp, 0, "", p->dictLen, p->code, &h);
+	}
+	header.codeHash = h;
+	ok = ok && !fseek(fp, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, fp) == 1;
+	if (fclose(fp) || !ok || rename(tmp, path))
+	{
+		remove(tmp);
+		free(tmp);
+		return ERROR_COMPILE;
+	}
+	free(tmp);
+	return 0;
+}
+
+// Check that code read from a file can run: every opcode exists, the words
+// and quotes it uses are there, its branches land inside it, and its loops
+// nest. Only the first numWords words of dict can be used.
+static int checkCode(struct Code *code, struct WordDict *dict, int numWords, int numQuotes)
+{
+	if (code->len < 1 || code->instrs[code->len - 1].op != OP_END)
+	{
+		return 0;
+	}
+	int loops = 0; // open for loops
+	for (int i = 0; i < code->len; i++)
+	{
+		struct Instr *in = &code->instrs[i];
+		if (in->op < 0 || in->op >= OP_COUNT || i + opEffects[in->op].size > code->len)
+		{
+			return 0;
+		}
+		if ((in->op == OP_WORD || in->op == OP_CALL)
+			&& (in->arg < 0 || in->arg >= numWords || !dict->words[in->arg].body != (in->op == OP_WORD)))
+		{
+			return 0;
+		}
+		if (in->op == OP_QUOTE && (in->arg < 0 || in->arg >= numQuotes))
+		{
+			return 0;
+		}
+		if (isBranch(in->op) && ((long)i + in->arg < 0 || (long)i + in->arg >= code->len))
+		{
+			return 0;
+		}
+		if ((in->op == OP_FOR && ++loops > CONTROL_DEPTH)
+			|| (in->op == OP_NEXT && --loops < 0)
+			|| (in->op == OP_INDEX && (in->arg < 0 || in->arg >= loops)))
+		{
+			return 0;
+		}
+	}
+	return loops == 0;
+}
+
+// Read the entry at *pos for a defined word or a quote into memory from the
+// arena, and move *pos past it. Returns 0 if it doesn't fit before end.
+static int readEntry(const char **pos, const char *end, struct WordDict *dict, struct CodeFileEntry *e, char **name, struct Code **code)
+{
+	if (end - *pos < (long)sizeof(*e))
+	{
+		return 0;
+	}
+	memcpy(e, *pos, sizeof(*e));
+	*pos += sizeof(*e);
+	if (e->nameLen < 0 || e->textLen < 0 || e->len < 0
+		|| end - *pos < e->nameLen + (long)e->textLen + (long)e->len * (long)sizeof(struct Instr))
+	{
+		return 0;
+	}
+
+	// The name and the text are copied with a 0 after each, like
+	// defineWord and addQuote do
+	*name = arenaAlloc(&dict->arena, e->nameLen + 1 + e->textLen + 1);
+	*code = arenaAlloc(&dict->arena, sizeof(**code));
+	struct Instr *instrs = arenaAlloc(&dict->arena, e->len * sizeof(*instrs));
+	if (!*name || !*code || (e->len && !instrs))
+	{
+		return 0;
+	}
+	char *text = *name + e->nameLen + 1;
+	memcpy(*name, *pos, e->nameLen);
+	(*name)[e->nameLen] = 0;
+	*pos += e->nameLen;
+	memcpy(text, *pos, e->textLen);
+	text[e->textLen] = 0;
+	*pos += e->textLen;
+	memcpy(instrs, *pos, e->len * sizeof(*instrs));
+	*pos += e->len * sizeof(*instrs);
+
+	memset(*code, 0, sizeof(**code));
+	(*code)->instrs = instrs;
+	(*code)->len = e->len;
+	(*code)->src = text;
+	(*code)->srcLen = e->textLen;
+	return 1;
+}
+
+// Add the words and quotes saved after the instructions to dict, in the
+// same order as they were defined, so that their indexes don't change
+static int loadEntries(struct CodeFile *header, const char *end, struct WordDict *dict)
+{
+	const char *pos = (const char *)(header + 1) + header->len * sizeof(struct Instr);
+	int base = dict->len;
+	for (int i = 0; i < header->numWords; i++)
+	{
+		struct CodeFileEntry e;
+		struct WordLookup w = {0};
+		char *name;
+		if (!readEntry(&pos, end, dict, &e, &name, &w.body)
+			|| !e.nameLen
+			|| !checkCode(w.body, dict, dict->len, header->numQuotes))
+		{
+			return 0;
+		}
+		w.len = e.nameLen;
+		w.name = name;
+		wordEffects(&w, dict);
+		if (addWord(dict, &w) < 0)
+		{
+			return 0;
+		}
+	}
+	for (int q = 0; q < header->numQuotes; q++)
+	{
+		struct CodeFileEntry e;
+		struct Quote p = {0};
+		char *name;
+		if (!readEntry(&pos, end, dict, &e, &name, &p.code)
+			|| e.nameLen
+			|| e.dictLen < base || e.dictLen > dict->len
+			|| !checkCode(p.code, dict, e.dictLen, header->numQuotes))
+		{
+			return 0;
+		}
+		p.len = e.textLen;
+		p.text = name + 1;
+		p.dictLen = e.dictLen;
+		verifyCode(p.code, dict);
+		if (appendQuote(dict, &p) < 0)
+		{
+			return 0;
+		}
+	}
+	return pos == end;
+}
+
+int loadCode(const char *path, int len, const char *str, struct WordDict *dict, struct Code *code)
+{
+	// The saved words and quotes are added back to the dictionary, so it
+	// can't have any of its own
+	for (int i = 0; i < dict->len; i++)
+	{
+		if (dict->words[i].body)
+		{
+			return ERROR_COMPILE;
+		}
+	}
+	if (dict->numQuotes)
+	{
+		return ERROR_COMPILE;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return ERROR_COMPILE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < (long)sizeof(struct CodeFile))
+	{
+		close(fd);
+		return ERROR_COMPILE;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return ERROR_COMPILE;
+	}
+
+	// The file must be for this text and this dictionary
+	struct CodeFile *header = map;
+	const char *end = (const char *)map + st.st_size;
+	if (memcmp(header->magic, "CSC3", 4)
+		|| header->format != CODE_FILE_FORMAT
+		|| header->srcLen != len
+		|| header->len < 0
+		|| header->len > (st.st_size - (long)sizeof(*header)) / (long)sizeof(struct Instr)
+		|| header->numWords < 0
+		|| header->numQuotes < 0
+		|| header->textHash != hashText(len, str)
+		|| header->dictHash != hashDict(dict)
+		|| header->codeHash != hashBytes(14695981039346656037ull, header + 1, end - (const char *)(header + 1)))
+	{
+		munmap(map, st.st_size);
+		return ERROR_COMPILE;
+	}
+
+	// The instructions are checked even so, because verified code runs
+	// without any bounds checks
+	memset(code, 0, sizeof(*code));
+	code->instrs = (struct Instr *)(header + 1);
+	code->len = header->len;
+	code->src = str;
+	code->srcLen = len;
+	code->map = map;
+	code->mapSize = st.st_size;
+	if (!loadEntries(header, end, dict) || !checkCode(code, dict, dict->len, dict->numQuotes))
+	{
+		resetDict(dict);
+		freeCode(code);
+		return ERROR_COMPILE;
+	}
+	return 0;
+}
+
+void freeCode(struct Code *code)
+{
+	freeJit(code);
+	if (code->map)
+	{
+		// The instructions are in the mapped file
+		munmap(code->map, code->mapSize);
+		code->map = NULL;
+	}
+	else if (code->cap)
+	{
+		free(code->instrs);
+	}
+	code->instrs = NULL;
+	code->len = 0;
+	code->cap = 0;
+}
+
+// Return the length of the longest prefix of buf that is made of complete
+// words and doesn't end inside a quote, definition or control structure. The
+// last word is only complete if it is followed by whitespace, or if the input
+// has ended.
+static int streamCut(const char *buf, int len, int eof)
+{
+	int cut = 0;
+	int depth = 0; // quote nesting
+	int i = 0;
+	while (i < len)
+	{
+		while (i < len && isspace(buf[i]))
+		{
+			i++;
+		}
+		int wstart = i;
+		while (i < len && !isspace(buf[i]))
+		{
+			i++;
+		}
+		if (i == len && !eof)
+		{
+			break;
+		}
+		int wlen = i - wstart;
+		int c = controlWord(wlen, buf + wstart);
+		int open = (wlen == 1 && (buf[wstart] == ':' || buf[wstart] == '['));
+		int close = (wlen == 1 && (buf[wstart] == ';' || buf[wstart] == ']'));
+		if (open || c == CTL_IF || c == CTL_BEGIN || c == CTL_FOR)
+		{
+			depth++;
+		}
+		else if ((close || c == CTL_THEN || c == CTL_UNTIL || c == CTL_NEXT) && depth > 0)
+		{
+			depth--;
+		}
+		if (!depth)
+		{
+			cut = i;
+		}
+	}
+	return cut;
+}
+
+int comRunStream(struct ComInterp *ci, int fd)
+{
+	int cap = STREAM_BUF_SZ;
+	int len = 0;
+	char *buf = malloc(cap + 1);
+	if (!buf)
+	{
+		return ERROR_COMPILE;
+	}
+	int eof = 0;
+	int err = 0;
+	while (!err && !(eof && !len))
+	{
+		if (!eof)
+		{
+			if (len == cap)
+			{
+				// A word or quote fills the whole buffer
+				char *bigger = realloc(buf, cap * 2 + 1);
+				if (!bigger)
+				{
+					err = ERROR_COMPILE;
+					break;
+				}
+				buf = bigger;
+				cap *= 2;
+			}
+			ssize_t n = read(fd, buf + len, cap - len);
+			if (n < 0)
+			{
+				err = ERROR_READ;
+				break;
+			}
+			eof = (n == 0);
+			len += n;
+		}
+
+		int cut = streamCut(buf, len, eof);
+		if (!cut)
+		{
+			if (eof)
+			{
+				// Only whitespace or an unclosed quote is left
+				cut = len;
+			}
+			else
+			{
+				continue;
+			}
+		}
+
+		// Words that parse ahead must stop at the end of the chunk
+		char after = buf[cut];
+		buf[cut] = 0;
+		struct Code code = {0};
+		err = compileScript(cut, buf, ci->dict, &code);
+		if (!err)
+		{
+			fuseCode(&code);
+			verifyCode(&code, ci->dict);
+			err = comRunCode(ci, &code);
+		}
+		freeCode(&code);
+
+		if (err)
+		{
+			// Keep the word at the error, since the buffer is freed below
+			static _Thread_local char errWord[64];
+			int n = 0;
+			if (ci->cursor >= buf && ci->cursor < buf + cut)
+			{
+				const char *w = ci->cursor;
+				while (n < (int)sizeof(errWord) - 1 && w + n < buf + cut && !isspace(w[n]))
+				{
+					errWord[n] = w[n];
+					n++;
+				}
+			}
+			errWord[n] = 0;
+			ci->cursor = errWord;
+		}
+
+		// The text that has run is discarded
+		buf[cut] = after;
+		memmove(buf, buf + cut, len - cut);
+		len -= cut;
+	}
+	free(buf);
+	return err;
+}
+
+int runStream(int fd, struct WordDict *dict)
+{
+	comCurrent->dict = dict;
+	return comRunStream(comCurrent, fd);
 }
 
 // convert runScript error code to message
@@ -302,6 +3316,10 @@ const char *errMessage(int code)
 		case ERROR_STACK_OVERFLOW: return "stack overflow";
 		case ERROR_STACK_UNDERFLOW: return "stack underflow";
 		case ERROR_WORD_NAME: return "unknown word name";
+		case ERROR_COMPILE: return "could not compile";
+		case ERROR_UNVERIFIED: return "stack effect can not be verified";
+		case ERROR_JIT: return "can not compile to machine code";
+		case ERROR_READ: return "could not read the script";
 		default: return "not a runScript error";
 	}
 }
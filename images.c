@@ -1,7 +1,31 @@
+// madvise, and the POSIX functions that comscript.h uses, are hidden by
+// strict modes such as -std=c99
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <stdlib.h> 
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Fill images with SSE2, AVX2 or AVX-512 stores, whichever the CPU has
+#ifndef IMAGES_SIMD
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define IMAGES_SIMD 1
+#else
+#define IMAGES_SIMD 0
+#endif
+#endif /* IMAGES_SIMD */
+
+#if IMAGES_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 #define DATA_STACK_SZ 128
 #define COMSCRIPT_IMPLEMENTATION
@@ -21,22 +45,64 @@ struct Image
 {
 	int width;
 	int height;
-	int *colors;
-};
-
-struct CodeQuote
-{
-	int length;
-	const char *start;
+	int *colors; // row by row, or NULL for a tiled image
+	int **tiles; // tilesX * tilesY tiles, row by row, or NULL where never written
+	int tilesX;
+	int tilesY;
+	int background; // the color of the tiles that are NULL
 };
 
 struct WordDict dict;
 
+// Print the superinstructions in each compiled script and quote
+int showFusions = 0;
+
+// File to write the profile to as CSV, instead of printing a table
+const char *profilePath = NULL;
+
+// File to write the trace events to, or NULL if not tracing
+const char *tracePath = NULL;
+
 // Array for holding allocated images
 struct Image **imagesArr = NULL;
 
-// Array for holding allocated code quotations
-struct CodeQuote **quotesArr = NULL;
+// Write the trace, and print how long the words took when built with
+// COMSCRIPT_PROFILE
+void report_run(void)
+{
+	if (tracePath)
+	{
+		FILE *fp = fopen(tracePath, "w");
+		if (fp)
+		{
+			writeTrace(fp, comCurrent);
+			fclose(fp);
+		}
+		else
+		{
+			fprintf(stderr, "warning: could not write \"%s\"\n", tracePath);
+		}
+		traceStop(comCurrent);
+		tracePath = NULL;
+	}
+#if COMSCRIPT_PROFILE
+	if (profilePath)
+	{
+		FILE *fp = fopen(profilePath, "w");
+		if (!fp)
+		{
+			fprintf(stderr, "warning: could not write \"%s\"\n", profilePath);
+			return;
+		}
+		printProfile(fp, comCurrent, 1);
+		fclose(fp);
+	}
+	else
+	{
+		printProfile(stderr, comCurrent, 0);
+	}
+#endif
+}
 
 // Add an image pointer to the imagesArr and return image ID/index.
 int ImageAdd(struct Image *p)
@@ -47,7 +113,6 @@ int ImageAdd(struct Image *p)
 		if (imagesArr[i] == NULL)
 		{
 			imagesArr[i] = p;
-			dpush(i);
 			return i;
 		}
 	}
@@ -65,7 +130,136 @@ int is_img(int i)
 
 int is_quote(int i)
 {
-	return 0 <= i && i < arrlen(quotesArr);
+	return 0 <= i && i < dict.numQuotes;
+}
+
+// Tiled images are split into tiles of TILE_SIZE x TILE_SIZE pixels
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+
+// alloc makes tiled images when they have more pixels than this
+#ifndef FLAT_MAX_PIXELS
+#define FLAT_MAX_PIXELS (1 << 26)
+#endif /* FLAT_MAX_PIXELS */
+
+// Make an image with every pixel 0, or NULL if it is too large. A tiled
+// image starts with no tiles at all.
+struct Image *image_new(int width, int height, int tiled)
+{
+	if (width <= 0 || height <= 0)
+	{
+		return NULL;
+	}
+	struct Image *p = calloc(1, sizeof(*p));
+	if (!p)
+	{
+		return NULL;
+	}
+	p->width = width;
+	p->height = height;
+	if (tiled)
+	{
+		p->tilesX = (width + TILE_SIZE - 1) >> TILE_SHIFT;
+		p->tilesY = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+		p->tiles = calloc((size_t)p->tilesX * p->tilesY, sizeof(*p->tiles));
+	}
+	else
+	{
+		p->colors = calloc((size_t)width * height, sizeof(*p->colors));
+	}
+	if (!p->tiles && !p->colors)
+	{
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+// Free the tiles of a tiled image, which makes every pixel the background.
+void image_free_tiles(struct Image *p)
+{
+	for (size_t t = 0; t < (size_t)p->tilesX * p->tilesY; t++)
+	{
+		free(p->tiles[t]);
+		p->tiles[t] = NULL;
+	}
+}
+
+void image_delete(struct Image *p)
+{
+	if (p->tiles)
+	{
+		image_free_tiles(p);
+		free(p->tiles);
+	}
+	free(p->colors);
+	free(p);
+}
+
+// Pointer to the pixel at (x, y), which must be inside the image. For a
+// tile that was never written to, this is NULL, or with alloc set, the
+// tile is allocated and filled with the background.
+int *pixel_at(struct Image *p, int x, int y, int alloc)
+{
+	if (!p->tiles)
+	{
+		return p->colors + x + (size_t)y * p->width;
+	}
+	int **tile = &p->tiles[(x >> TILE_SHIFT) + (size_t)(y >> TILE_SHIFT) * p->tilesX];
+	if (!*tile)
+	{
+		if (!alloc)
+		{
+			return NULL;
+		}
+		*tile = malloc(TILE_SIZE * TILE_SIZE * sizeof(**tile));
+		assert(*tile);
+		for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++)
+		{
+			(*tile)[i] = p->background;
+		}
+	}
+	return *tile + (x & (TILE_SIZE - 1)) + ((y & (TILE_SIZE - 1)) << TILE_SHIFT);
+}
+
+// Number of pixels that follow (x, y) in memory, on the same row.
+int span_len(struct Image *p, int x)
+{
+	int end = p->tiles? (x | (TILE_SIZE - 1)) + 1 : p->width;
+	return ((end < p->width)? end : p->width) - x;
+}
+
+int get_pixel(struct Image *p, int x, int y)
+{
+	int *c = pixel_at(p, x, y, 0);
+	return c? *c : p->background;
+}
+
+void set_pixel(struct Image *p, int x, int y, int val)
+{
+	int *c = pixel_at(p, x, y, val != p->background);
+	if (c)
+	{
+		*c = val;
+	}
+}
+
+// Copy n pixels of a row, starting at (x, y), into buf.
+void read_row(struct Image *p, int x, int y, int n, int *buf)
+{
+	while (n > 0)
+	{
+		int len = span_len(p, x);
+		len = (len < n)? len : n;
+		int *c = pixel_at(p, x, y, 0);
+		for (int i = 0; i < len; i++)
+		{
+			buf[i] = c? c[i] : p->background;
+		}
+		buf += len;
+		x += len;
+		n -= len;
+	}
 }
 
 // ( r g b a -- rgba )
@@ -168,269 +362,922 @@ void img_rect(void)
 		return;
 	}
 
+	if (x0 < 0 || y0 < 0 || w <= 0 || h <= 0)
+	{
+		printf("rect: outside the image");
+		return;
+	}
+
 	// Horizontal lines
 	for (int x = x0; x < (x0 + w) && x < imgW; x++)
 	{
-		int i;
-		i = x + y0 * imgW;
-		p->colors[i] = val;
-		i = x + (y0 + h - 1) * imgW;
-		p->colors[i] = val;
+		set_pixel(p, x, y0, val);
+		set_pixel(p, x, y0 + h - 1, val);
 	}
 
 	// Vertical lines
 	for (int y = y0; y < (y0 + h) && y < imgH; y++)
 	{
-		int i;
-		i = x0 + y * imgW;
-		p->colors[i] = val;
-		i = (x0 + w - 1) + y * imgW;
-		p->colors[i] = val;
+		set_pixel(p, x0, y, val);
+		set_pixel(p, x0 + w - 1, y, val);
 	}
 }
 
-// ( img x0 y0 w h val -- img ) fill rectangle
-void img_fillrect(void)
+// Set n pixels to val, one at a time.
+void fill_scalar(int *dst, size_t n, int val, int stream)
 {
-	int val = dpop();
-	int h = dpop();
-	int w = dpop();
-	int y0 = dpop();
-	int x0 = dpop();
-	int img = dtop();
-
-	if (!is_img(img))
+	(void)stream; // only here so every fill kernel has the same signature
+	unsigned int v = val;
+	if ((v & 0xff) * 0x01010101u == v)
 	{
-		printf("rect: invalid image\n");
+		// Every byte of val is the same
+		memset(dst, val & 0xff, n * sizeof(*dst));
 		return;
 	}
-	struct Image *p = imagesArr[img];
-	int imgW = p->width;
-	int imgH = p->height;
+	for (size_t i = 0; i < n; i++)
+	{
+		dst[i] = val;
+	}
+}
 
-	for (int x = x0; x < (x0 + w) && x < imgW; x++)
+#if IMAGES_SIMD
+// Each SIMD fill sets pixels one at a time until dst is aligned to its
+// vector size, then stores whole vectors. With stream set, the stores
+// bypass the cache, for fills that would only evict everything else.
+__attribute__((target("sse2")))
+void fill_sse2(int *dst, size_t n, int val, int stream)
+{
+	size_t i = 0;
+	for (; i < n && ((uintptr_t)(dst + i) & 15); i++)
+	{
+		dst[i] = val;
+	}
+	__m128i v = _mm_set1_epi32(val);
+	if (stream)
+	{
+		for (; i + 4 <= n; i += 4)
+		{
+			_mm_stream_si128((__m128i *)(dst + i), v);
+		}
+		_mm_sfence();
+	}
+	else
 	{
-		for (int y = y0; y < (y0 + h) && y < imgH; y++)
+		for (; i + 4 <= n; i += 4)
 		{
-			int i = x + y * imgW;
-			p->colors[i] = val;
+			_mm_store_si128((__m128i *)(dst + i), v);
 		}
 	}
+	for (; i < n; i++)
+	{
+		dst[i] = val;
+	}
 }
 
-// ( img x0 y0 x1 y1 val -- img ) draw line
-void img_line(void)
+__attribute__((target("avx2")))
+void fill_avx2(int *dst, size_t n, int val, int stream)
 {
-	int val = dpop();
-	int y1 = dpop();
-	int x1 = dpop();
-	int y0 = dpop();
-	int x0 = dpop();
-	int img = dtop();
-
-	if (!is_img(img))
+	size_t i = 0;
+	for (; i < n && ((uintptr_t)(dst + i) & 31); i++)
 	{
-		printf("error: line: not an image\n");
-		return;
+		dst[i] = val;
 	}
-	struct Image *p = imagesArr[img];
-
-	if (x0 < 0 || x0 >= p->width)
+	__m256i v = _mm256_set1_epi32(val);
+	if (stream)
 	{
-		printf("error: line: x0 out of bounds\n");
-		return;
+		for (; i + 8 <= n; i += 8)
+		{
+			_mm256_stream_si256((__m256i *)(dst + i), v);
+		}
+		_mm_sfence();
 	}
-
-	if (y0 < 0 || y0 >= p->height)
+	else
 	{
-		printf("error: line: y0 out of bounds\n");
-		return;
+		for (; i + 8 <= n; i += 8)
+		{
+			_mm256_store_si256((__m256i *)(dst + i), v);
+		}
 	}
-
-	if (x1 < 0 || x1 >= p->width)
+	for (; i < n; i++)
 	{
-		printf("error: line: x1 out of bounds\n");
-		return;
+		dst[i] = val;
 	}
+}
 
-	if (y1 < 0 || y1 >= p->height)
+__attribute__((target("avx512f")))
+void fill_avx512(int *dst, size_t n, int val, int stream)
+{
+	size_t i = 0;
+	for (; i < n && ((uintptr_t)(dst + i) & 63); i++)
 	{
-		printf("error: line: y1 out of bounds\n");
-		return;
+		dst[i] = val;
 	}
-
-	int dx = x1 - x0;
-	if (dx < 0) { dx = -dx; }
-	int sx = (x0 < x1)? 1 : -1;
-	int dy = y1 - y0;
-	if (dy > 0) { dy = -dy; }
-	int sy = (y0 < y1)? 1 : -1;
-	int error = dx + dy;
-	int e2;
-	while (1)
+	__m512i v = _mm512_set1_epi32(val);
+	if (stream)
 	{
-		// Plot (x0, y0)
-		int i = x0 + y0 * p->width;
-		assert(0 <= i && i < p->width * p->height);
-		p->colors[i] = val;
-
-		if (x0 == x1 && y0 == y1) { break; }
-		e2 = 2 * error;
-		if (e2 >= dy)
+		for (; i + 16 <= n; i += 16)
 		{
-			if (x0 == x1) { break; }
-			error = error + dy;
-			x0 = x0 + sx;
+			_mm512_stream_si512((void *)(dst + i), v);
 		}
-		if (e2 <= dx)
+		_mm_sfence();
+	}
+	else
+	{
+		for (; i + 16 <= n; i += 16)
 		{
-			if (y0 == y1) { break; }
-			error = error + dx;
-			y0 = y0 + sy;
+			_mm512_store_si512((void *)(dst + i), v);
 		}
 	}
+	for (; i < n; i++)
+	{
+		dst[i] = val;
+	}
 }
+#endif /* IMAGES_SIMD */
 
-// ( width height -- imgID )
-void img_alloc(void)
+// Ways to draw one image onto another, for blit_rect and the blend kernels
+enum
 {
-	int height = dpop();
-	int width = dpop();
-	int size = width * height;
+	BLIT_COPY,     // replace the pixels
+	BLIT_OVER,     // source-over, by the alpha of img2
+	BLIT_ADD,      // add each channel, up to 255
+	BLIT_MULTIPLY, // multiply each channel, as fractions of 255
+};
 
-	struct Image *new = malloc(sizeof(*new));
-	new->width = width;
-	new->height = height;
-	new->colors = malloc(size * sizeof(*new->colors));
+// x / 255, rounded, for x from 0 to 255 * 255
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
 
-	dpush(ImageAdd(new));
-}
-void img_free(void)
+// Blend n pixels of src onto dst, one channel at a time. The SIMD kernels
+// do the same arithmetic, so every kernel gives the same pixels.
+void blend_scalar(int mode, int *dst, const int *src, size_t n)
 {
-	int imageIndex = dpop();
-	if (0 <= imageIndex && imageIndex < arrlen(imagesArr))
+	for (size_t i = 0; i < n; i++)
 	{
-		struct Image *p = imagesArr[imageIndex];
-
-		free(p->colors);
-		free(p);
-		imagesArr[imageIndex] = NULL; // put a 'hole' in the array
+		unsigned int s = src[i];
+		unsigned int d = dst[i];
+		unsigned int sa = s >> 24;
+		unsigned int out = 0;
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			unsigned int sc = (s >> shift) & 255;
+			unsigned int dc = (d >> shift) & 255;
+			unsigned int c;
+			if (mode == BLIT_OVER)
+			{
+				// The alpha channel is blended as if its source were 255
+				sc = (shift == 24)? 255 : sc;
+				c = DIV255(sc * sa + dc * (255 - sa));
+			}
+			else if (mode == BLIT_ADD)
+			{
+				c = (sc + dc > 255)? 255 : sc + dc;
+			}
+			else
+			{
+				c = DIV255(sc * dc);
+			}
+			out |= c << shift;
+		}
+		dst[i] = out;
 	}
 }
 
-// Clear image to certain value
-// ( img v -- img )
-void img_clear(void)
+#if IMAGES_SIMD
+// Blend 4 pixels, widened to 16 bits per channel in two halves.
+__attribute__((target("sse2")))
+static __m128i blend4_sse2(int mode, __m128i s, __m128i d)
 {
-	int val = dpop();
-	int img = dpick(0);
-	if (!is_img(img))
+	if (mode == BLIT_ADD)
 	{
-		// invalid image index
-		printf("clear: invalid image\n");
-		return;
+		return _mm_adds_epu8(s, d);
 	}
-	else
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	__m128i half[2];
+	for (int h = 0; h < 2; h++)
 	{
-		assert(imagesArr);
-		struct Image *p = imagesArr[img];
-		assert(p);
-		int size = p->width * p->height;
-		for (int i = 0; i < size; i++)
+		__m128i s16 = h? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+		__m128i d16 = h? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+		__m128i t;
+		if (mode == BLIT_OVER)
+		{
+			__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+			__m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), sa);
+			s16 = _mm_or_si128(s16, _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0));
+			t = _mm_add_epi16(_mm_mullo_epi16(s16, sa), _mm_mullo_epi16(d16, ia));
+		}
+		else
 		{
-			p->colors[i] = val;
+			t = _mm_mullo_epi16(s16, d16);
 		}
+		t = _mm_add_epi16(t, round);
+		half[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
 	}
+	return _mm_packus_epi16(half[0], half[1]);
 }
 
-// ( img x y -- img val )
-void img_get(void)
+__attribute__((target("sse2")))
+void blend_sse2(int mode, int *dst, const int *src, size_t n)
 {
-	int y = dpop();
-	int x = dpop();
-	int img = dtop();
-	if (is_img(img))
-	{
-		// invalid image index
-		dpush(0);
-	}
-	else
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
 	{
-		struct Image *p = imagesArr[img];
-		int j = x + y * p->width;
-		dpush(p->colors[j]);
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), blend4_sse2(mode, s, d));
 	}
+	blend_scalar(mode, dst + i, src + i, n - i);
 }
 
-// ( img x y val -- img val )
-void img_set(void)
+// Blend 8 pixels, the same way as blend4_sse2 in each 128-bit lane.
+__attribute__((target("avx2")))
+static __m256i blend8_avx2(int mode, __m256i s, __m256i d)
 {
-	int val = dpop();
-	int y = dpop();
-	int x = dpop();
-	int img = dpick(0);
-	dpush(val);
-
-	if (is_img(img))
+	if (mode == BLIT_ADD)
 	{
-		struct Image *p = imagesArr[img];
-		int i = x + y * p->width;
-		int size = p->width * p->height;
-		if (0 <= i && i < size)
+		return _mm256_adds_epu8(s, d);
+	}
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i round = _mm256_set1_epi16(128);
+	__m256i half[2];
+	for (int h = 0; h < 2; h++)
+	{
+		__m256i s16 = h? _mm256_unpackhi_epi8(s, zero) : _mm256_unpacklo_epi8(s, zero);
+		__m256i d16 = h? _mm256_unpackhi_epi8(d, zero) : _mm256_unpacklo_epi8(d, zero);
+		__m256i t;
+		if (mode == BLIT_OVER)
+		{
+			__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xff), 0xff);
+			__m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), sa);
+			s16 = _mm256_or_si256(s16, _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0,
+					255, 0, 0, 0, 255, 0, 0, 0));
+			t = _mm256_add_epi16(_mm256_mullo_epi16(s16, sa), _mm256_mullo_epi16(d16, ia));
+		}
+		else
 		{
-			p->colors[i] = val;
+			t = _mm256_mullo_epi16(s16, d16);
 		}
+		t = _mm256_add_epi16(t, round);
+		half[h] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
 	}
+	return _mm256_packus_epi16(half[0], half[1]);
 }
 
-// ( img x1 y1 x2 y2 -- img ) swaps values in image
-void img_swap(void)
+__attribute__((target("avx2")))
+void blend_avx2(int mode, int *dst, const int *src, size_t n)
 {
-	int y2 = dpop();
-	int x2 = dpop();
-	int y1 = dpop();
-	int x1 = dpop();
-	int img = dtop();
-
-	if (is_img(img))
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
 	{
-		struct Image *p = imagesArr[img];
-		int i1 = x1 + y1 * p->width;
-		int i2 = x2 + y2 * p->width;
-		int size = p->width * p->height;
-		if (i1 != i2 && 0 <= i1 && i1 < size && 0 <= i2 && i2 < size)
-		{
-			int temp = p->colors[i1];
-			p->colors[i1] = p->colors[i2];
-			p->colors[i2] = temp;
-		}
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), blend8_avx2(mode, s, d));
 	}
+	blend_scalar(mode, dst + i, src + i, n - i);
 }
+#endif /* IMAGES_SIMD */
 
-// ( img1 -- img1 img2 ) makes a copy of an image
-void img_copy(void)
+// Instruction sets, in cpuFeatures
+enum
 {
-	int img1 = dtop();
-	if (is_img(img1))
-	{
-		struct Image *p1 = imagesArr[img1];
+	CPU_SSE2 = 1,
+	CPU_AVX2 = 2,
+	CPU_AVX512 = 4,
+};
 
-		// Allocate a new image
-		dpush(p1->width);
-		dpush(p1->height);
-		img_alloc();
+// The instruction sets that this CPU and OS support, set by init_simd
+int cpuFeatures = 0;
 
-		int img2 = dtop();
-		struct Image *p2 = imagesArr[img2];
+struct FillKernel
+{
+	const char *name;
+	void (*fill)(int *dst, size_t n, int val, int stream);
+	int needs; // CPU_ flags
+};
 
-		assert(p1 != p2);
-		assert(p1->width == p2->width);
-		assert(p1->height == p2->height);
+// Fill kernels, from the slowest to the fastest
+struct FillKernel fillKernels[] =
+{
+	{"scalar", fill_scalar, 0},
+#if IMAGES_SIMD
+	{"sse2",   fill_sse2,   CPU_SSE2},
+	{"avx2",   fill_avx2,   CPU_AVX2},
+	{"avx512", fill_avx512, CPU_AVX512},
+#endif
+};
+int numFillKernels = sizeof(fillKernels)/sizeof(fillKernels[0]);
+
+// The fastest available fill kernel
+struct FillKernel *fillKernel = &fillKernels[0];
+
+struct BlendKernel
+{
+	const char *name;
+	void (*blend)(int mode, int *dst, const int *src, size_t n);
+	int needs; // CPU_ flags
+};
+
+// Blend kernels, from the slowest to the fastest
+struct BlendKernel blendKernels[] =
+{
+	{"scalar", blend_scalar, 0},
+#if IMAGES_SIMD
+	{"sse2",   blend_sse2,   CPU_SSE2},
+	{"avx2",   blend_avx2,   CPU_AVX2},
+#endif
+};
+int numBlendKernels = sizeof(blendKernels)/sizeof(blendKernels[0]);
+
+// The fastest available blend kernel
+struct BlendKernel *blendKernel = &blendKernels[0];
+
+// Fills of more bytes than this use streaming stores: the size of the
+// last-level cache.
+size_t fillStreamBytes = 8 << 20;
+
+#if IMAGES_SIMD
+// Which register state the OS saves, from XCR0
+static unsigned long long read_xcr0(void)
+{
+	unsigned int eax, edx;
+	__asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+}
+#endif
+
+// Whether the CPU has every instruction set in needs
+int has_cpu(int needs)
+{
+	return (cpuFeatures & needs) == needs;
+}
+
+// Pick the fill and blend kernels with cpuid, before main runs.
+__attribute__((constructor))
+void init_simd(void)
+{
+#if IMAGES_SIMD
+	unsigned int a, b, c, d;
+	if (__get_cpuid(1, &a, &b, &c, &d))
+	{
+		cpuFeatures |= ((d >> 26) & 1)? CPU_SSE2 : 0;
+		// AVX needs the OS to save the upper halves of the registers
+		int osxsave = (c >> 27) & 1;
+		unsigned long long xcr0 = osxsave? read_xcr0() : 0;
+		if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		{
+			cpuFeatures |= (((b >> 5) & 1) && (xcr0 & 0x06) == 0x06)? CPU_AVX2 : 0;
+			cpuFeatures |= (((b >> 16) & 1) && (xcr0 & 0xe6) == 0xe6)? CPU_AVX512 : 0;
+		}
+	}
+#endif
+	for (int i = 0; i < numFillKernels; i++)
+	{
+		if (has_cpu(fillKernels[i].needs))
+		{
+			fillKernel = &fillKernels[i];
+		}
+	}
+	for (int i = 0; i < numBlendKernels; i++)
+	{
+		if (has_cpu(blendKernels[i].needs))
+		{
+			blendKernel = &blendKernels[i];
+		}
+	}
+#ifdef _SC_LEVEL3_CACHE_SIZE
+	long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (llc > 0)
+	{
+		fillStreamBytes = llc;
+	}
+#endif
+}
+
+// Images with fewer pixels than this are done on the calling thread
+#ifndef PARALLEL_MIN_PIXELS
+#define PARALLEL_MIN_PIXELS (1 << 18)
+#endif /* PARALLEL_MIN_PIXELS */
+
+// Bands of rows per thread, so that threads that finish early take more
+#define BANDS_PER_THREAD 4
+
+// A kernel run by parallel_rows on the rows from y0 up to y1
+typedef void (*RowsFunc)(void *arg, int y0, int y1);
+
+// Threads that share the rows of the image kernels. The job is split into
+// bands, and each thread (including the one that called parallel_rows)
+// takes the next band that nobody has taken until there are none left.
+struct Pool
+{
+	pthread_t *threads;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // a new job, or quit
+	pthread_cond_t done; // the last worker left the job
+	pthread_mutex_t busy; // held by the thread that is running a job
+	int job;    // counts the jobs, so a worker can tell a new one
+	int active; // workers in the job
+	int quit;
+	RowsFunc func;
+	void *arg;
+	int rows;
+	int bands;
+	_Atomic int nextBand;
+};
+
+struct Pool pool =
+{
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.busy = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Run bands of the current job until they are all taken.
+static void pool_run_bands(void)
+{
+	int b;
+	while ((b = atomic_fetch_add(&pool.nextBand, 1)) < pool.bands)
+	{
+		int y0 = (int)((long long)pool.rows * b / pool.bands);
+		int y1 = (int)((long long)pool.rows * (b + 1) / pool.bands);
+		pool.func(pool.arg, y0, y1);
+	}
+}
+
+static void *pool_worker(void *unused)
+{
+	(void)unused;
+	int seen = 0;
+	pthread_mutex_lock(&pool.lock);
+	while (1)
+	{
+		while (!pool.quit && pool.job == seen)
+		{
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		if (pool.quit)
+		{
+			break;
+		}
+		seen = pool.job;
+		pool.active++;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_run_bands();
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.active == 0)
+		{
+			pthread_cond_signal(&pool.done);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
 
-		int size = p1->width * p1->width;
-		for (int i = 0; i < size; i++)
+// Start threads - 1 workers, to run with the main thread.
+void pool_start(int threads)
+{
+	pool.count = 0;
+	pool.threads = malloc(sizeof(*pool.threads) * (threads > 1? threads - 1 : 1));
+	for (int i = 0; i < threads - 1; i++)
+	{
+		if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL))
 		{
-			p2->colors[i] = p1->colors[i];
+			break;
+		}
+		pool.count++;
+	}
+}
+
+// Stop and join the workers.
+void pool_stop(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < pool.count; i++)
+	{
+		pthread_join(pool.threads[i], NULL);
+	}
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.count = 0;
+	pool.quit = 0;
+}
+
+// Run func on the rows from 0 up to rows, split across the pool when there
+// are at least PARALLEL_MIN_PIXELS pixels. Each band of rows must only
+// write to its own rows, so the result is the same as one call of func.
+void parallel_rows(int rows, size_t rowPixels, RowsFunc func, void *arg)
+{
+	if (pool.count == 0 || rows < 2 || rows * rowPixels < PARALLEL_MIN_PIXELS
+			|| pthread_mutex_trylock(&pool.busy))
+	{
+		// Small, or another thread is using the pool
+		func(arg, 0, rows);
+		return;
+	}
+	int bands = (pool.count + 1) * BANDS_PER_THREAD;
+	pthread_mutex_lock(&pool.lock);
+	// A worker may have woken for the last job after it was done
+	while (pool.active > 0)
+	{
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pool.func = func;
+	pool.arg = arg;
+	pool.rows = rows;
+	pool.bands = (bands < rows)? bands : rows;
+	atomic_store(&pool.nextBand, 0);
+	pool.job++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_run_bands();
+
+	// Every band has been taken, so wait for the workers that took them
+	pthread_mutex_lock(&pool.lock);
+	while (pool.active > 0)
+	{
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.busy);
+}
+
+// Rows of pixels to fill, for fill_rows
+struct FillJob
+{
+	int *colors; // first pixel of the first row
+	int stride;  // pixels from one row to the next
+	int n;       // pixels to fill in each row
+	int val;
+	int stream;
+};
+
+static void fill_rows(void *arg, int y0, int y1)
+{
+	struct FillJob *j = arg;
+	if (j->n == j->stride)
+	{
+		// The rows are contiguous
+		fillKernel->fill(j->colors + (size_t)y0 * j->stride, (size_t)(y1 - y0) * j->n, j->val, j->stream);
+		return;
+	}
+	for (int y = y0; y < y1; y++)
+	{
+		fillKernel->fill(j->colors + (size_t)y * j->stride, j->n, j->val, j->stream);
+	}
+}
+
+// Rows of pixels to copy or blend, for copy_rows and blend_rows
+struct CopyJob
+{
+	int mode; // BLIT_ mode, for blend_rows
+	int *dst;
+	int dstStride;
+	const int *src;
+	int srcStride;
+	int n; // pixels in each row
+};
+
+static void copy_rows(void *arg, int y0, int y1)
+{
+	struct CopyJob *j = arg;
+	for (int y = y0; y < y1; y++)
+	{
+		memcpy(j->dst + (size_t)y * j->dstStride, j->src + (size_t)y * j->srcStride, j->n * sizeof(int));
+	}
+}
+
+static void blend_rows(void *arg, int y0, int y1)
+{
+	struct CopyJob *j = arg;
+	for (int y = y0; y < y1; y++)
+	{
+		blendKernel->blend(j->mode, j->dst + (size_t)y * j->dstStride, j->src + (size_t)y * j->srcStride, j->n);
+	}
+}
+
+// Fill the pixels from (x0, y0) up to (x1, y1) of a tiled image, one tile
+// at a time. Tiles that were never written to stay that way if val is the
+// background.
+void fill_tiles(struct Image *p, int x0, int y0, int x1, int y1, int val)
+{
+	for (int ty = y0 >> TILE_SHIFT; ty <= (y1 - 1) >> TILE_SHIFT; ty++)
+	{
+		for (int tx = x0 >> TILE_SHIFT; tx <= (x1 - 1) >> TILE_SHIFT; tx++)
+		{
+			int left = (tx << TILE_SHIFT > x0)? tx << TILE_SHIFT : x0;
+			int right = ((tx + 1) << TILE_SHIFT < x1)? (tx + 1) << TILE_SHIFT : x1;
+			int top = (ty << TILE_SHIFT > y0)? ty << TILE_SHIFT : y0;
+			int bottom = ((ty + 1) << TILE_SHIFT < y1)? (ty + 1) << TILE_SHIFT : y1;
+			if (!pixel_at(p, left, top, 0) && val == p->background)
+			{
+				continue;
+			}
+			for (int y = top; y < bottom; y++)
+			{
+				fillKernel->fill(pixel_at(p, left, y, 1), right - left, val, 0);
+			}
+		}
+	}
+}
+
+// ( img x0 y0 w h val -- img ) fill rectangle
+void img_fillrect(void)
+{
+	int val = dpop();
+	int h = dpop();
+	int w = dpop();
+	int y0 = dpop();
+	int x0 = dpop();
+	int img = dtop();
+
+	if (!is_img(img))
+	{
+		printf("rect: invalid image\n");
+		return;
+	}
+	struct Image *p = imagesArr[img];
+
+	// Clip the rectangle to the image
+	int x1 = (x0 + w < p->width)? x0 + w : p->width;
+	int y1 = (y0 + h < p->height)? y0 + h : p->height;
+	if (x0 < 0) { x0 = 0; }
+	if (y0 < 0) { y0 = 0; }
+	if (x0 >= x1 || y0 >= y1)
+	{
+		return;
+	}
+
+	if (p->tiles)
+	{
+		fill_tiles(p, x0, y0, x1, y1, val);
+		return;
+	}
+
+	struct FillJob job =
+	{
+		.colors = p->colors + x0 + (size_t)y0 * p->width,
+		.stride = p->width,
+		.n = x1 - x0,
+		.val = val,
+		.stream = (size_t)(x1 - x0) * (y1 - y0) * sizeof(int) > fillStreamBytes,
+	};
+	parallel_rows(y1 - y0, job.n, fill_rows, &job);
+}
+
+// ( img x0 y0 x1 y1 val -- img ) draw line
+void img_line(void)
+{
+	int val = dpop();
+	int y1 = dpop();
+	int x1 = dpop();
+	int y0 = dpop();
+	int x0 = dpop();
+	int img = dtop();
+
+	if (!is_img(img))
+	{
+		printf("error: line: not an image\n");
+		return;
+	}
+	struct Image *p = imagesArr[img];
+
+	if (x0 < 0 || x0 >= p->width)
+	{
+		printf("error: line: x0 out of bounds\n");
+		return;
+	}
+
+	if (y0 < 0 || y0 >= p->height)
+	{
+		printf("error: line: y0 out of bounds\n");
+		return;
+	}
+
+	if (x1 < 0 || x1 >= p->width)
+	{
+		printf("error: line: x1 out of bounds\n");
+		return;
+	}
+
+	if (y1 < 0 || y1 >= p->height)
+	{
+		printf("error: line: y1 out of bounds\n");
+		return;
+	}
+
+	int dx = x1 - x0;
+	if (dx < 0) { dx = -dx; }
+	int sx = (x0 < x1)? 1 : -1;
+	int dy = y1 - y0;
+	if (dy > 0) { dy = -dy; }
+	int sy = (y0 < y1)? 1 : -1;
+	int error = dx + dy;
+	int e2;
+	while (1)
+	{
+		// Plot (x0, y0)
+		assert(0 <= x0 && x0 < p->width && 0 <= y0 && y0 < p->height);
+		set_pixel(p, x0, y0, val);
+
+		if (x0 == x1 && y0 == y1) { break; }
+		e2 = 2 * error;
+		if (e2 >= dy)
+		{
+			if (x0 == x1) { break; }
+			error = error + dy;
+			x0 = x0 + sx;
+		}
+		if (e2 <= dx)
+		{
+			if (y0 == y1) { break; }
+			error = error + dx;
+			y0 = y0 + sy;
+		}
+	}
+}
+
+// Push a new image, or -1 if it can't be made.
+void alloc_image(const char *name, int tiled)
+{
+	int height = dpop();
+	int width = dpop();
+	struct Image *new = image_new(width, height, tiled);
+	if (!new)
+	{
+		printf("%s: can't make a %dx%d image\n", name, width, height);
+		dpush(-1);
+		return;
+	}
+	dpush(ImageAdd(new));
+}
+
+// ( width height -- imgID ) images with more than FLAT_MAX_PIXELS are tiled
+void img_alloc(void)
+{
+	int height = dpick(0);
+	int width = dpick(1);
+	alloc_image("alloc", (long long)width * height > FLAT_MAX_PIXELS);
+}
+
+// ( width height -- imgID ) tiled image, where only the tiles that are
+// drawn on use memory
+void img_alloc_tiled(void)
+{
+	alloc_image("alloc.tiled", 1);
+}
+
+void img_free(void)
+{
+	int imageIndex = dpop();
+	if (0 <= imageIndex && imageIndex < arrlen(imagesArr) && imagesArr[imageIndex])
+	{
+		image_delete(imagesArr[imageIndex]);
+		imagesArr[imageIndex] = NULL; // put a 'hole' in the array
+	}
+}
+
+// Clear image to certain value
+// ( img v -- img )
+void img_clear(void)
+{
+	int val = dpop();
+	int img = dpick(0);
+	if (!is_img(img))
+	{
+		// invalid image index
+		printf("clear: invalid image\n");
+		return;
+	}
+	else
+	{
+		assert(imagesArr);
+		struct Image *p = imagesArr[img];
+		assert(p);
+		if (p->tiles)
+		{
+			// Every tile is the background again
+			image_free_tiles(p);
+			p->background = val;
+			return;
+		}
+		struct FillJob job =
+		{
+			.colors = p->colors,
+			.stride = p->width,
+			.n = p->width,
+			.val = val,
+			.stream = (size_t)p->width * p->height * sizeof(int) > fillStreamBytes,
+		};
+		parallel_rows(p->height, p->width, fill_rows, &job);
+	}
+}
+
+// ( img x y -- img val )
+void img_get(void)
+{
+	int y = dpop();
+	int x = dpop();
+	int img = dtop();
+	if (!is_img(img))
+	{
+		// invalid image index
+		dpush(0);
+		return;
+	}
+	struct Image *p = imagesArr[img];
+	if (0 <= x && x < p->width && 0 <= y && y < p->height)
+	{
+		dpush(get_pixel(p, x, y));
+	}
+	else
+	{
+		dpush(0);
+	}
+}
+
+// ( img x y val -- img val )
+void img_set(void)
+{
+	int val = dpop();
+	int y = dpop();
+	int x = dpop();
+	int img = dpick(0);
+	dpush(val);
+
+	if (is_img(img))
+	{
+		struct Image *p = imagesArr[img];
+		if (0 <= x && x < p->width && 0 <= y && y < p->height)
+		{
+			set_pixel(p, x, y, val);
+		}
+	}
+}
+
+// ( img x1 y1 x2 y2 -- img ) swaps values in image
+void img_swap(void)
+{
+	int y2 = dpop();
+	int x2 = dpop();
+	int y1 = dpop();
+	int x1 = dpop();
+	int img = dtop();
+
+	if (is_img(img))
+	{
+		struct Image *p = imagesArr[img];
+		if (0 <= x1 && x1 < p->width && 0 <= y1 && y1 < p->height
+				&& 0 <= x2 && x2 < p->width && 0 <= y2 && y2 < p->height)
+		{
+			int temp = get_pixel(p, x1, y1);
+			set_pixel(p, x1, y1, get_pixel(p, x2, y2));
+			set_pixel(p, x2, y2, temp);
+		}
+	}
+}
+
+// ( img1 -- img1 img2 ) makes a copy of an image
+void img_copy(void)
+{
+	int img1 = dtop();
+	if (is_img(img1))
+	{
+		struct Image *p1 = imagesArr[img1];
+
+		// Allocate a new image with the same layout
+		struct Image *p2 = image_new(p1->width, p1->height, p1->tiles != NULL);
+		if (!p2)
+		{
+			printf("copy: can't make a %dx%d image\n", p1->width, p1->height);
+			dpush(-1);
+			return;
+		}
+		dpush(ImageAdd(p2));
+
+		if (p1->tiles)
+		{
+			// Only copy the tiles that were written to
+			p2->background = p1->background;
+			for (size_t t = 0; t < (size_t)p1->tilesX * p1->tilesY; t++)
+			{
+				if (p1->tiles[t])
+				{
+					p2->tiles[t] = malloc(TILE_SIZE * TILE_SIZE * sizeof(int));
+					assert(p2->tiles[t]);
+					memcpy(p2->tiles[t], p1->tiles[t], TILE_SIZE * TILE_SIZE * sizeof(int));
+				}
+			}
+		}
+		else
+		{
+			memcpy(p2->colors, p1->colors, (size_t)p1->width * p1->height * sizeof(*p1->colors));
 		}
 	}
 	else
@@ -449,12 +1296,11 @@ void img_disp(void)
 		struct Image *p = imagesArr[img];
 		assert(p);
 		printf("Image #%d (%dx%d):\n", img, p->width, p->height);
-		for (int x = 0; x < p->width; x++)
+		for (int y = 0; y < p->height; y++)
 		{
-			for (int y = 0; y < p->height; y++)
+			for (int x = 0; x < p->width; x++)
 			{
-				int j = x + y * p->width;
-				printf(" %2d", p->colors[j]);
+				printf(" %2d", get_pixel(p, x, y));
 			}
 			putchar('\n');
 		}
@@ -512,14 +1358,32 @@ void img_save(void)
 
 	int width = p->width;
 	int height = p->height;
-	void *data = p->colors;
-	int comp = sizeof(*p->colors);
-	int stride = width * sizeof(*p->colors);
-	int success = stbi_write_png(name, width, height, comp, data, stride);
+	int *data = p->colors;
+	if (p->tiles)
+	{
+		// Put the rows of the tiles together
+		if ((long long)width * height > FLAT_MAX_PIXELS)
+		{
+			printf("could not save image #%d: too large\n", img);
+			return;
+		}
+		data = malloc((size_t)width * height * sizeof(*data));
+		for (int y = 0; data && y < height; y++)
+		{
+			read_row(p, 0, y, width, data + (size_t)y * width);
+		}
+	}
+	int comp = sizeof(*data);
+	int stride = width * sizeof(*data);
+	int success = data && stbi_write_png(name, width, height, comp, data, stride);
 	if (!success)
 	{
 		printf("could not save image #%d\n", img);
 	}
+	if (data != p->colors)
+	{
+		free(data);
+	}
 }
 
 // ( name -- img )
@@ -542,70 +1406,23 @@ void img_load(void)
 	}
 
 	// Alloc new image struct
-	struct Image *new = malloc(sizeof(*new));
+	struct Image *new = image_new(width, height, 0);
 	assert(new);
-	int size = width * height;
-	new->width = width;
-	new->height = height;
-	new->colors = malloc(size * sizeof(*new->colors));
-	assert(new->colors);
 
 	// Copy image data
-	int *dataI = (int *)data;
-	for (int i = 0; i < size; i++)
-	{
-		new->colors[i] = dataI[i];
-	}
+	memcpy(new->colors, data, (size_t)width * height * sizeof(*new->colors));
 	// Done with loaded data
 	stbi_image_free(data);
 
-	dpush(ImageAdd(new));
-	return;
-}
-
-void bye(void)
-{
-	printf("bye\n");
-	exit(0);
-}
-
-// Runs when a '[' is first encountered
-void quote_code(void)
-{
-	// Skip to opening bracket
-	while (*prog && *prog != '[')
-	{
-		prog++;
-	}
-	// Skip opening bracket
-	prog++;
-
-	const char *quote_begin = prog;
-	while (*prog && *prog != ']')
-	{
-		prog++;
-	}
-
-	if (*prog == ']')
-	{
-		// Skip closing bracket
-		prog++;
-
-		// TODO: free this allocated quote at the end of the program
-		int len = prog - quote_begin - 1;
-		struct CodeQuote *new = malloc(sizeof(*new));
-		new->length = len;
-		new->start = quote_begin;
-
-		int index = arrlen(quotesArr);
-		arrpush(quotesArr, new);
-		dpush(index);
-	}
-	else
-	{
-		printf("quoting word '[' : error\n");
-		dpush(-1);
-	}
+	dpush(ImageAdd(new));
+	return;
+}
+
+void bye(void)
+{
+	printf("bye\n");
+	report_run();
+	exit(0);
 }
 
 // ( quote -- ? )
@@ -615,8 +1432,7 @@ void do_quote(void)
 	if (is_quote(quote))
 	{
 		const char *save_prog = prog;
-		struct CodeQuote *p = quotesArr[quote];
-		runScript(p->length, p->start, &dict);
+		runCode(dict.quotes[quote].code, &dict);
 		prog = save_prog;
 	}
 }
@@ -634,15 +1450,157 @@ void do_times(void)
 	}
 
 	const char *save_prog = prog;
-	struct CodeQuote *p = quotesArr[q];
+	struct Code *code = dict.quotes[q].code;
 	while (n > 0)
 	{
-		runScript(p->length, p->start, &dict);
+		runCode(code, &dict);
 		n--;
 	}
 	prog = save_prog;
 }
 
+// Draw img2 onto img1 with one of the BLIT_ modes, where either image is
+// tiled. The rectangle is already clipped: rows of rowW pixels from
+// (sx, sy) in img2 go to (dx, dy) in img1. Each row is done in spans that
+// stay inside one tile of each image.
+void blit_tiles(struct Image *p1, struct Image *p2, int dx, int dy, int sx, int sy,
+		int rowW, int rows, int mode)
+{
+	// Pixels of img2 from tiles that were never written to
+	int background[TILE_SIZE];
+	for (int i = 0; i < TILE_SIZE; i++)
+	{
+		background[i] = p2->background;
+	}
+	// What those pixels make of img1's background
+	int blank = p1->background;
+	if (mode == BLIT_COPY)
+	{
+		blank = p2->background;
+	}
+	else
+	{
+		blendKernel->blend(mode, &blank, background, 1);
+	}
+
+	// An image drawn onto itself reads a copy of each row, and the rows go
+	// in the order that reads each one before it is overwritten.
+	int *row = (p1 == p2)? malloc(rowW * sizeof(*row)) : NULL;
+	int step = (p1 == p2 && dy > sy)? -1 : 1;
+	int start = (step < 0)? rows - 1 : 0;
+	for (int n = 0, y = start; n < rows; n++, y += step)
+	{
+		if (row)
+		{
+			read_row(p2, sx, sy + y, rowW, row);
+		}
+		for (int x = 0; x < rowW; )
+		{
+			int len = span_len(p1, dx + x);
+			int srcLen = span_len(p2, sx + x);
+			len = (len < srcLen)? len : srcLen;
+			len = (len < rowW - x)? len : rowW - x;
+			const int *src = row? row + x : pixel_at(p2, sx + x, sy + y, 0);
+			int *dst = pixel_at(p1, dx + x, dy + y, 0);
+			if (!src)
+			{
+				if (!dst && blank == p1->background)
+				{
+					// Nothing would change
+					x += len;
+					continue;
+				}
+				src = background;
+			}
+			if (!dst)
+			{
+				dst = pixel_at(p1, dx + x, dy + y, 1);
+			}
+			if (mode == BLIT_COPY)
+			{
+				memcpy(dst, src, len * sizeof(*dst));
+			}
+			else
+			{
+				blendKernel->blend(mode, dst, src, len);
+			}
+			x += len;
+		}
+	}
+	free(row);
+}
+
+// Draw img2 onto img1 at (x0, y0) with one of the BLIT_ modes.
+void blit_image(struct Image *p1, struct Image *p2, int x0, int y0, int mode)
+{
+	// Clip img2 to the part that lands inside img1
+	int sx = (x0 < 0)? -x0 : 0;
+	int sy = (y0 < 0)? -y0 : 0;
+	int x1 = (x0 + p2->width < p1->width)? x0 + p2->width : p1->width;
+	int y1 = (y0 + p2->height < p1->height)? y0 + p2->height : p1->height;
+	int rowW = x1 - (x0 + sx);
+	int rows = y1 - (y0 + sy);
+	if (rowW <= 0 || rows <= 0)
+	{
+		return;
+	}
+
+	if (p1->tiles || p2->tiles)
+	{
+		blit_tiles(p1, p2, x0 + sx, y0 + sy, sx, sy, rowW, rows, mode);
+		return;
+	}
+
+	struct CopyJob job =
+	{
+		.mode = mode,
+		.dst = p1->colors + (x0 + sx) + (size_t)(y0 + sy) * p1->width,
+		.dstStride = p1->width,
+		.src = p2->colors + sx + (size_t)sy * p2->width,
+		.srcStride = p2->width,
+		.n = rowW,
+	};
+	if (mode == BLIT_COPY && p1 != p2)
+	{
+		parallel_rows(rows, rowW, copy_rows, &job);
+		return;
+	}
+	if (mode == BLIT_COPY)
+	{
+		// When blitting an image onto itself, copy the rows in the order
+		// that reads each one before it is overwritten.
+		int step = (p1 == p2 && y0 > 0)? -1 : 1;
+		int start = (step < 0)? rows - 1 : 0;
+		for (int n = 0, y = sy + start; n < rows; n++, y += step)
+		{
+			memmove(p1->colors + (x0 + sx) + (size_t)(y0 + y) * p1->width,
+					p2->colors + sx + (size_t)y * p2->width,
+					rowW * sizeof(*p1->colors));
+		}
+		return;
+	}
+
+	// Blending an image onto itself reads a copy of the source rectangle
+	int *copy = NULL;
+	if (p1 == p2)
+	{
+		copy = malloc((size_t)rowW * rows * sizeof(*copy));
+		struct CopyJob copyJob =
+		{
+			.dst = copy,
+			.dstStride = rowW,
+			.src = job.src,
+			.srcStride = job.srcStride,
+			.n = rowW,
+		};
+		parallel_rows(rows, rowW, copy_rows, &copyJob);
+		job.src = copy;
+		job.srcStride = rowW;
+	}
+	parallel_rows(rows, rowW, blend_rows, &job);
+	free(copy);
+}
+
 // ( img x0 y0 w h -- img ) crop image to rect
 void img_crop(void)
 {
@@ -667,22 +1625,53 @@ void img_crop(void)
 		return;
 	}
 
-	// Create new colors array
-	int size = w * h;
-	int *newColors = malloc(size * sizeof(*newColors));
-	// Copy the pixels from img into the new colors
-	int i, val;
-	for (int x = 0; x < w && (x0 + x) < p->width; x++)
+	if (p->tiles)
 	{
-		for (int y = 0; y < h && (y0 + y) < p->height; y++)
+		// Draw the region onto a new tiled image, and take its tiles
+		struct Image *q = image_new(w, h, 1);
+		if (!q)
+		{
+			printf("resize: can't make a %dx%d image\n", w, h);
+			return;
+		}
+		q->background = p->background;
+		blit_image(q, p, -x0, -y0, BLIT_COPY);
+		if (x0 + w > p->width)
+		{
+			fill_tiles(q, p->width - x0, 0, w, h, 0);
+		}
+		if (y0 + h > p->height)
 		{
-			i = (x0 + x) + (y0 + y) * p->width; // index into img
-			val = p->colors[i];
-			i = x + y * w; // index into newColors
-			newColors[i] = val;
+			fill_tiles(q, 0, p->height - y0, w, h, 0);
 		}
+		image_free_tiles(p);
+		free(p->tiles);
+		*p = *q;
+		free(q);
+		return;
 	}
 
+	// Create new colors array, where the part of the region outside img is 0
+	int *newColors = (x0 + w > p->width || y0 + h > p->height)?
+		calloc((size_t)w * h, sizeof(*newColors)) :
+		malloc((size_t)w * h * sizeof(*newColors));
+	if (!newColors)
+	{
+		printf("resize: can't make a %dx%d image\n", w, h);
+		return;
+	}
+	// Copy the rows of the region that are inside img into the new colors
+	struct CopyJob job =
+	{
+		.dst = newColors,
+		.dstStride = w,
+		.src = p->colors + x0 + (size_t)y0 * p->width,
+		.srcStride = p->width,
+		.n = (x0 + w < p->width)? w : p->width - x0,
+	};
+	int rows = (y0 + h < p->height)? h : p->height - y0;
+	parallel_rows(rows, job.n, copy_rows, &job);
+
 	// Replace the image's colors
 	free(p->colors);
 	p->colors = newColors;
@@ -691,8 +1680,8 @@ void img_crop(void)
 	p->height = h;
 }
 
-// ( img1 img2 x0 y0 -- img1 ) blit img2 onto img1
-void img_blit(void)
+// ( img1 img2 x0 y0 -- img1 ) draw img2 onto img1 with one of the BLIT_ modes
+void blit_rect(const char *name, int mode)
 {
 	int y0 = dpop();
 	int x0 = dpop();
@@ -701,29 +1690,98 @@ void img_blit(void)
 
 	if (!is_img(img2))
 	{
-		printf("blit: img2 not an image\n");
+		printf("%s: img2 not an image\n", name);
 		return;
 	}
 	if (!is_img(img1))
 	{
-		printf("blit: img1 not an image\n");
+		printf("%s: img1 not an image\n", name);
 		return;
 	}
 
-	struct Image *p1 = imagesArr[img1];
-	struct Image *p2 = imagesArr[img2];
+	blit_image(imagesArr[img1], imagesArr[img2], x0, y0, mode);
+}
+
+// ( img1 img2 x0 y0 -- img1 ) blit img2 onto img1
+void img_blit(void)
+{
+	blit_rect("blit", BLIT_COPY);
+}
+
+// ( img1 img2 x0 y0 -- img1 ) blend img2 over img1 by the alpha of img2
+void img_blit_over(void)
+{
+	blit_rect("blit.over", BLIT_OVER);
+}
+
+// ( img1 img2 x0 y0 -- img1 ) add img2 to img1
+void img_blit_add(void)
+{
+	blit_rect("blit.add", BLIT_ADD);
+}
+
+// ( img1 img2 x0 y0 -- img1 ) multiply img1 by img2
+void img_blit_multiply(void)
+{
+	blit_rect("blit.mul", BLIT_MULTIPLY);
+}
+
+// Rows of two images to compare, for equal_rows
+struct EqualJob
+{
+	const int *colors1;
+	const int *colors2;
+	int width;
+	_Atomic int differ;
+};
+
+static void equal_rows(void *arg, int y0, int y1)
+{
+	struct EqualJob *j = arg;
+	size_t start = (size_t)y0 * j->width;
+	size_t n = (size_t)(y1 - y0) * j->width;
+	if (!atomic_load(&j->differ) && memcmp(j->colors1 + start, j->colors2 + start, n * sizeof(int)))
+	{
+		atomic_store(&j->differ, 1);
+	}
+}
 
-	int i, val;
-	for (int x = 0; x < p2->width && (x0 + x) < p1->width; x++)
+// Whether two images of the same size have the same pixels, when either is
+// tiled. They are compared a tile at a time, and tiles that neither image
+// has written to only compare the backgrounds.
+int tiles_equal(struct Image *p1, struct Image *p2)
+{
+	for (int by = 0; by < p1->height; by += TILE_SIZE)
 	{
-		for (int y = 0; y < p2->height && (y0 + y) < p1->height; y++)
+		int h = (by + TILE_SIZE < p1->height)? TILE_SIZE : p1->height - by;
+		for (int bx = 0; bx < p1->width; bx += TILE_SIZE)
 		{
-			i = x + y * p2->width;
-			val = p2->colors[i];
-			i = (x0 + x) + (y0 + y) * p1->width;
-			p1->colors[i] = val;
+			int w = (bx + TILE_SIZE < p1->width)? TILE_SIZE : p1->width - bx;
+			if (!pixel_at(p1, bx, by, 0) && !pixel_at(p2, bx, by, 0))
+			{
+				if (p1->background != p2->background)
+				{
+					return 0;
+				}
+				continue;
+			}
+			for (int y = by; y < by + h; y++)
+			{
+				const int *row1 = pixel_at(p1, bx, y, 0);
+				const int *row2 = pixel_at(p2, bx, y, 0);
+				for (int i = 0; i < w; i++)
+				{
+					int c1 = row1? row1[i] : p1->background;
+					int c2 = row2? row2[i] : p2->background;
+					if (c1 != c2)
+					{
+						return 0;
+					}
+				}
+			}
 		}
 	}
+	return 1;
 }
 
 // ( img1 img2 -- flag )
@@ -736,12 +1794,14 @@ void img_equal(void)
 	{
 		printf("img= error: img2 not an image\n");
 		dpush(0);
+		return;
 	}
 
 	if (!is_img(img1))
 	{
 		printf("img= error: img1 not an image\n");
 		dpush(0);
+		return;
 	}
 
 	// Images equal themselves
@@ -761,67 +1821,66 @@ void img_equal(void)
 		return;
 	}
 
-	// Compare contents
-	int size = p1->width * p1->height;
-	for (int i = 0; i < size; i++)
+	if (p1->tiles || p2->tiles)
 	{
-		if (p1->colors[i] != p2->colors[i])
-		{
-			dpush(0);
-			return;
-		}
+		dpush(tiles_equal(p1, p2));
+		return;
 	}
 
-	// Equal
-	dpush(1);
-	return;
+	// Compare contents
+	struct EqualJob job = { p1->colors, p2->colors, p1->width, 0 };
+	parallel_rows(p1->height, p1->width, equal_rows, &job);
+	dpush(!atomic_load(&job.differ));
 }
 
 struct WordLookup words[] =
 {
-	{1, "+",     add,       2, 1},
-	{1, "-",     subtract,  2, 1},
-	{1, "*",     multiply,  2, 1},
-	{1, "/",     divide,    2, 1},
-	{4, "drop",  drop,      1, 0},
-	{3, "dup",   duplicate, 1, 2},
-	{4, "swap",  swap,      2, 2},
-	{4, "over",  over,      2, 3},
-	{3, "nip",   nip,       2, 1},
-
-	{3, "bye",   bye,       0, 0},
-	{2, ".s",    dispstack, 0, 0},
-	{1, ".",     dprint,    1, 0},
-	{5, "space", space,     0, 0},
-	{4, "emit",  emit,      1, 0},
-
-	{1, "[",     quote_code, 0, 1}, // ( -- codequote )
-	{2, "do",    do_quote,   1, 0}, // ( codequote -- ? )
-	{5, "times", do_times,   2, 0}, // ( codequote n -- ? )
-
-	{3,  "rgb",        rgb,    3, 1},     // ( r g b -- rgba )
-	{4,  "rgba",       rgba,   4, 1},     // ( r g b a -- rgba )
-	{5,  "value",      value,  1, 1},     // ( val -- rgba )
-	{10, "rgb.invert", rgb_invert, 1, 1}, // ( rgba1 -- rgba2 ) invert rgb values
-
-	{7, "display",  img_disp,     1, 1 }, // ( img -- img )
-	{5, "alloc",    img_alloc,    2, 1 }, // ( w h -- img )
-	{4, "free",     img_free,     1, 0 }, // ( img -- )
-	{5, "width",    img_width,    1, 2 }, // ( img -- img w )
-	{6, "height",   img_height,   1, 2 }, // ( img -- img h )
-	{5, "clear",    img_clear,    2, 1 }, // ( img val -- img )
-	{3, "get",      img_get,      3, 2 }, // ( img x y -- img val )
-	{3, "set",      img_set,      4, 2 }, // ( img x y val -- img val )
-	{5, "iswap",    img_swap,     5, 1 }, // ( img x1 y1 x2 y2 -- img ) swaps values in image
-	{4, "copy",     img_copy,     1, 2 }, // ( img1 -- img1 img2 ) makes a copy of an image
-	{4, "save",     img_save,     2, 1 }, // ( img name -- img ) name is an int to append to filename
-	{4, "load",     img_load,     1, 1 }, // ( name -- img ) name is an int to append to filename
-	{4, "rect",     img_rect,     5, 1 }, // ( img x0 y0 w h val -- img ) draw rectangle
-	{8, "fillrect", img_fillrect, 5, 1 }, // ( img x0 y0 w h val -- img ) fill rectangle
-	{4, "line",     img_line,     6, 1 }, // ( img x0 y0 x1 y1 val -- img ) draw line
-	{4, "crop",     img_crop,     5, 1 }, // ( img x0 y0 w h -- img ) crop image to rect
-	{4, "blit",     img_blit,     4, 1 }, // ( img1 img2 x0 y0 -- img1 ) blit img2 onto img1
-	{4, "img=",     img_equal,    2, 1 }, // ( img1 img2 -- flag ) see if 2 images have same data
+	WORD_ENTRY(1, "+",     add,       2, 1, 0, "add"),
+	WORD_ENTRY(1, "-",     subtract,  2, 1, 0, "subtract"),
+	WORD_ENTRY(1, "*",     multiply,  2, 1, 0, "multiply"),
+	WORD_ENTRY(1, "/",     divide,    2, 1, 0, "divide"),
+	WORD_ENTRY(4, "drop",  drop,      1, 0, 0, "drop"),
+	WORD_ENTRY(3, "dup",   duplicate, 1, 2, 0, "duplicate"),
+	WORD_ENTRY(4, "swap",  swap,      2, 2, 0, "swap"),
+	WORD_ENTRY(4, "over",  over,      2, 3, 0, "over"),
+	WORD_ENTRY(3, "nip",   nip,       2, 1, 0, "nip"),
+
+	WORD_ENTRY(3, "bye",   bye,       0, 0, 0, "bye"),
+	WORD_ENTRY(2, ".s",    dispstack, 0, 0, 0, "dispstack"),
+	WORD_ENTRY(1, ".",     dprint,    1, 0, 0, "dprint"),
+	WORD_ENTRY(5, "space", space,     0, 0, 0, "space"),
+	WORD_ENTRY(4, "emit",  emit,      1, 0, 0, "emit"),
+
+	WORD_ENTRY(2, "do",    do_quote,   1, 0, WORD_DYNAMIC, "do_quote"),   // ( codequote -- ? )
+	WORD_ENTRY(5, "times", do_times,   2, 0, WORD_DYNAMIC, "do_times"),   // ( codequote n -- ? )
+
+	WORD_ENTRY(3,  "rgb",        rgb,        3, 1, 0, "rgb"),        // ( r g b -- rgba )
+	WORD_ENTRY(4,  "rgba",       rgba,       4, 1, 0, "rgba"),       // ( r g b a -- rgba )
+	WORD_ENTRY(5,  "value",      value,      1, 1, 0, "value"),      // ( val -- rgba )
+	WORD_ENTRY(10, "rgb.invert", rgb_invert, 1, 1, 0, "rgb_invert"), // ( rgba1 -- rgba2 ) invert rgb values
+
+	WORD_ENTRY(7, "display",  img_disp,     1, 1, 0, "img_disp"), // ( img -- img )
+	WORD_ENTRY(5, "alloc",    img_alloc,    2, 1, 0, "img_alloc"), // ( w h -- img )
+	WORD_ENTRY(11, "alloc.tiled", img_alloc_tiled, 2, 1, 0, "img_alloc_tiled"), // ( w h -- img ) only the tiles drawn on use memory
+	WORD_ENTRY(4, "free",     img_free,     1, 0, 0, "img_free"), // ( img -- )
+	WORD_ENTRY(5, "width",    img_width,    1, 2, 0, "img_width"), // ( img -- img w )
+	WORD_ENTRY(6, "height",   img_height,   1, 2, 0, "img_height"), // ( img -- img h )
+	WORD_ENTRY(5, "clear",    img_clear,    2, 1, 0, "img_clear"), // ( img val -- img )
+	WORD_ENTRY(3, "get",      img_get,      3, 2, 0, "img_get"), // ( img x y -- img val )
+	WORD_ENTRY(3, "set",      img_set,      4, 2, 0, "img_set"), // ( img x y val -- img val )
+	WORD_ENTRY(5, "iswap",    img_swap,     5, 1, 0, "img_swap"), // ( img x1 y1 x2 y2 -- img ) swaps values in image
+	WORD_ENTRY(4, "copy",     img_copy,     1, 2, 0, "img_copy"), // ( img1 -- img1 img2 ) makes a copy of an image
+	WORD_ENTRY(4, "save",     img_save,     2, 1, 0, "img_save"), // ( img name -- img ) name is an int to append to filename
+	WORD_ENTRY(4, "load",     img_load,     1, 1, 0, "img_load"), // ( name -- img ) name is an int to append to filename
+	WORD_ENTRY(4, "rect",     img_rect,     6, 1, 0, "img_rect"), // ( img x0 y0 w h val -- img ) draw rectangle
+	WORD_ENTRY(8, "fillrect", img_fillrect, 6, 1, 0, "img_fillrect"), // ( img x0 y0 w h val -- img ) fill rectangle
+	WORD_ENTRY(4, "line",     img_line,     6, 1, 0, "img_line"), // ( img x0 y0 x1 y1 val -- img ) draw line
+	WORD_ENTRY(4, "crop",     img_crop,     5, 1, 0, "img_crop"), // ( img x0 y0 w h -- img ) crop image to rect
+	WORD_ENTRY(4, "blit",     img_blit,     4, 1, 0, "img_blit"), // ( img1 img2 x0 y0 -- img1 ) blit img2 onto img1
+	WORD_ENTRY(9, "blit.over", img_blit_over, 4, 1, 0, "img_blit_over"), // ( img1 img2 x0 y0 -- img1 ) blend img2 over img1 by its alpha
+	WORD_ENTRY(8, "blit.add",  img_blit_add,  4, 1, 0, "img_blit_add"), // ( img1 img2 x0 y0 -- img1 ) add img2 to img1
+	WORD_ENTRY(8, "blit.mul",  img_blit_multiply, 4, 1, 0, "img_blit_multiply"), // ( img1 img2 x0 y0 -- img1 ) multiply img1 by img2
+	WORD_ENTRY(4, "img=",     img_equal,    2, 1, 0, "img_equal"), // ( img1 img2 -- flag ) see if 2 images have same data
 };
 struct WordDict dict =
 {
@@ -829,51 +1888,383 @@ struct WordDict dict =
 	.words = words,
 };
 
+// A script compiled into the program from C written by `--emit-c`
+struct AotScript
+{
+	const char *name;
+	int (*run)(void);
+};
+
+struct AotScript *aotScripts = NULL;
+
+// Called by the generated C code before main() runs
+void aotRegister(const char *name, int (*run)(void))
+{
+	struct AotScript s = { name, run };
+	arrpush(aotScripts, s);
+}
+
+// See if name can be pasted into C identifiers, which is if it matches
+// [A-Za-z_][A-Za-z0-9_]*
+int is_c_name(const char *name)
+{
+	if (!isalpha((unsigned char)name[0]) && name[0] != '_')
+	{
+		return 0;
+	}
+	for (int i = 1; name[i]; i++)
+	{
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Write the compiled script as C code for a named entry point
+int emit_c(const char *name, struct Code *code)
+{
+	printf("// Generated by `images --emit-c %s`\n", name);
+	printf("#define DATA_STACK_SZ %d\n", DATA_STACK_SZ);
+	printf("#include \"comscript.h\"\n\n");
+
+	char func[100];
+	snprintf(func, sizeof(func), "script_%s", name);
+	int err = transpileCode(stdout, func, code, &dict);
+	if (err)
+	{
+		return err;
+	}
+
+	printf("\nvoid aotRegister(const char *name, int (*run)(void));\n");
+	printf("static void register_%s(void) __attribute__((constructor));\n", name);
+	printf("static void register_%s(void)\n{\n\taotRegister(\"%s\", %s);\n}\n", name, name, func);
+	return 0;
+}
+
+void print_error(int code)
+{
+	printf("error: %d: %s", code, errMessage(code));
+	if (prog && code == ERROR_WORD_NAME)
+	{
+		const char *wstart;
+		int wlen;
+		word(prog, &wstart, &wlen);
+		printf(": %.*s\n", wlen, wstart);
+	}
+	else
+	{
+		printf("\n");
+	}
+}
+
+// Map the script file into memory read-only, so it isn't copied into the
+// heap. The text interpreter reads words with word(), which scans past the
+// end of a word until a 0 byte or space. The mapping only has that 0 byte
+// after the end of the file if the file doesn't fill its last page.
+// Otherwise, and if the file can't be mapped, it is read into a buffer with a
+// 0 byte at the end instead.
+char *load_script(const char *fname, int *size, int *mapped)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size > INT_MAX - 1)
+	{
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+
+	if (*size > 0 && *size % sysconf(_SC_PAGESIZE))
+	{
+		char *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED)
+		{
+			madvise(p, *size, MADV_SEQUENTIAL);
+			close(fd);
+			*mapped = 1;
+			return p;
+		}
+	}
+
+	char *p = malloc(*size + 1);
+	int num = 0;
+	while (p && num < *size)
+	{
+		ssize_t n = read(fd, p + num, *size - num);
+		if (n <= 0)
+		{
+			free(p);
+			p = NULL;
+			break;
+		}
+		num += n;
+	}
+	close(fd);
+	if (p)
+	{
+		p[*size] = 0;
+	}
+	*mapped = 0;
+	return p;
+}
+
+// Free the quotes and words that the script defined, all at once
+void end_script(int showStats)
+{
+	report_run();
+	if (showStats)
+	{
+		struct ArenaStats st = arenaStats(&dict.arena);
+		fprintf(stderr, "arena: %ld bytes used, %ld bytes peak, %ld bytes in %d blocks\n",
+				st.used, st.peak, st.reserved, st.blocks);
+	}
+	resetDict(&dict);
+	freeDictIndex(&dict);
+}
+
+#ifndef IMAGES_NO_MAIN
 int main(int argc, char **argv)
 {
-	if (argc < 2)
+	const char *fname = NULL;
+	int useText = 0; // interpret the text directly instead of compiling it
+	int mustVerify = 0; // refuse to run scripts that don't pass verifyCode
+	const char *emitName = NULL; // write the script as C code with this name
+	const char *runName = NULL; // run the compiled-in script with this name
+	int useJit = 0; // compile scripts to machine code where possible
+	const char *cacheDir = NULL; // directory to keep compiled scripts in
+	int useStream = 0; // run the script as it is read instead of loading it all first
+	int showStats = 0; // print the memory used by quotes and definitions
+	long long traceMin = 0; // only trace words that take at least this many nanoseconds
+	int traceSize = 1 << 16; // number of trace events to keep
+	int threads = sysconf(_SC_NPROCESSORS_ONLN); // threads for the image words
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--text"))
+		{
+			useText = 1;
+		}
+		else if (!strcmp(argv[i], "--fusions"))
+		{
+			showFusions = 1;
+		}
+		else if (!strcmp(argv[i], "--verify"))
+		{
+			mustVerify = 1;
+		}
+		else if (!strcmp(argv[i], "--jit"))
+		{
+			useJit = 1;
+		}
+		else if (!strcmp(argv[i], "--stream"))
+		{
+			useStream = 1;
+		}
+		else if (!strcmp(argv[i], "--stats"))
+		{
+			showStats = 1;
+		}
+		else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+		{
+			tracePath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--trace-min") && i + 1 < argc)
+		{
+			traceMin = atoll(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--trace-size") && i + 1 < argc)
+		{
+			traceSize = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--profile") && i + 1 < argc)
+		{
+			profilePath = argv[++i];
+			if (!COMSCRIPT_PROFILE)
+			{
+				fprintf(stderr, "warning: built without COMSCRIPT_PROFILE, so there is no profile\n");
+			}
+		}
+		else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+		{
+			cacheDir = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--emit-c") && i + 1 < argc)
+		{
+			emitName = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--run") && i + 1 < argc)
+		{
+			runName = argv[++i];
+		}
+		else
+		{
+			fname = argv[i];
+		}
+	}
+
+	if (emitName && !is_c_name(emitName))
+	{
+		printf("error: --emit-c name \"%s\" must be letters, digits and '_', and not start with a digit\n", emitName);
+		return 1;
+	}
+
+	pool_start(threads);
+	// Join the workers however main ends, including the exit in `bye`
+	atexit(pool_stop);
+
+	// The trace events are allocated before the script runs
+	if (tracePath && traceStart(comCurrent, traceSize, traceMin))
+	{
+		printf("error: could not allocate %d trace events\n", traceSize);
+		return 1;
+	}
+
+	if (runName)
+	{
+		for (int i = 0; i < arrlen(aotScripts); i++)
+		{
+			if (!strcmp(aotScripts[i].name, runName))
+			{
+				int code = aotScripts[i].run();
+				if (code)
+				{
+					print_error(code);
+				}
+				end_script(showStats);
+				return code;
+			}
+		}
+		printf("error: no compiled-in script named \"%s\"\n", runName);
+		return 1;
+	}
+
+	if (!fname)
 	{
 		printf("error: missing required argument: file\n");
 		return 1;
 	}
 
-	const char *fname = argv[1];
-	FILE *fp = fopen(fname, "r");
-	if (!fp)
+	// "-" reads the script from stdin, which may be a pipe
+	if (useStream || !strcmp(fname, "-"))
+	{
+		int fd = strcmp(fname, "-")? open(fname, O_RDONLY) : STDIN_FILENO;
+		if (fd < 0)
+		{
+			printf("error: could not open \"%s\"\n", fname);
+			return 1;
+		}
+		indexDict(&dict);
+		int code = runStream(fd, &dict);
+		if (code)
+		{
+			print_error(code);
+		}
+		if (fd != STDIN_FILENO)
+		{
+			close(fd);
+		}
+		end_script(showStats);
+		return code;
+	}
+
+	int size;
+	int mapped;
+	char *script = load_script(fname, &size, &mapped);
+	if (!script)
 	{
 		printf("error: could not open \"%s\"\n", fname);
 		return 1;
 	}
 
-	fseek(fp, 0, SEEK_END); // seek to end of file
-	int size = ftell(fp); // get current file pointer
-	fseek(fp, 0, SEEK_SET); // seek back to beginning of file
-
-	char *script = malloc(size);
-	int num = fread(script, 1, size, fp);
-	fclose(fp);
+	indexDict(&dict);
 
-	int code = 1;
-	if (num == size)
+	int code = 0;
+	if (useText)
 	{
 		code = runScript(size, script, &dict);
-		if (code)
+	}
+	else
+	{
+		struct Code compiled = {0};
+		int verifyErr = 0;
+
+		// Use the compiled script from the cache if it is up to date
+		char cachePath[1024];
+		int cached = 0;
+		if (cacheDir)
+		{
+			snprintf(cachePath, sizeof(cachePath), "%s/%016llx.csc", cacheDir, hashText(size, script));
+			cached = !loadCode(cachePath, size, script, &dict, &compiled);
+		}
+
+		if (cached)
 		{
-			printf("error: %d: %s", code, errMessage(code));
-			if (prog && code == ERROR_WORD_NAME)
+			code = 0;
+			verifyErr = verifyCode(&compiled, &dict);
+		}
+		else
+		{
+			code = compileScript(size, script, &dict, &compiled);
+			if (!code)
 			{
-				const char *wstart;
-				int wlen;
-				word(prog, &wstart, &wlen);
-				printf(": %.*s\n", wlen, wstart);
+				fuseCode(&compiled);
+				if (showFusions)
+				{
+					printFusions(stderr, &compiled, &dict);
+				}
+				// Verified scripts run without checking the stack at every word
+				verifyErr = verifyCode(&compiled, &dict);
+				if (cacheDir && saveCode(cachePath, &compiled, &dict))
+				{
+					fprintf(stderr, "warning: could not write \"%s\"\n", cachePath);
+				}
 			}
-			else
+		}
+
+		if (!code)
+		{
+			if (verifyErr && (mustVerify || emitName))
+			{
+				code = verifyErr;
+			}
+			// Falls back to the interpreter if the JIT can't compile it
+			if (!verifyErr && useJit)
 			{
-				printf("\n");
+				jitCode(&compiled, &dict);
 			}
 		}
+		if (!code && emitName)
+		{
+			code = emit_c(emitName, &compiled);
+		}
+		else if (!code)
+		{
+			code = runCode(&compiled, &dict);
+		}
+		freeCode(&compiled);
 	}
-	free(script);
+	if (code)
+	{
+		print_error(code);
+	}
+	if (mapped)
+	{
+		munmap(script, size);
+	}
+	else
+	{
+		free(script);
+	}
+	end_script(showStats);
 	return code;
 }
-
+#endif /* IMAGES_NO_MAIN */